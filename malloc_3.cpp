@@ -2,6 +2,18 @@
 #include <cstring>
 #include <unistd.h>
 #include <cstdlib>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <cstddef>
+#include <ctime>
+#include <sched.h>
+#include <climits>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/auxv.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 
 //#include <iostream>
@@ -11,201 +23,3289 @@
 #define LARGE_ENOUGH 128
 #define SIZE_NOT_ALIGNED(size) (size%4!=0)
 #define ALIGN_SIZE(size) (4-(size%4))
+#ifndef PERCPU_CACHE
+#define PERCPU_CACHE 0                              //1: the caches belong to CPUs (rseq), to threads where rseq is missing
+#endif
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT (PERCPU_CACHE ? 16 : 0)        //blocks a thread keeps per size bin, 0: no thread caches
+#endif
+#if PERCPU_CACHE && !TCACHE_COUNT
+#error "PERCPU_CACHE needs TCACHE_COUNT"
+#endif
+#define TCACHE_MAX_SIZE 1024                        //bigger requests always go to the shared heap
+#define TCACHE_BIN_STEP 16
+#define TCACHE_BINS (TCACHE_MAX_SIZE/TCACHE_BIN_STEP)
+#define TCACHE_BATCH ((TCACHE_COUNT+1)/2)           //blocks moved per refill or flush
+#define TCACHE_KEY block_key(0x74636163686521ULL)
+#if PERCPU_CACHE && defined(__linux__) && defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#define PERCPU_RSEQ 1                               //the restartable sequences below are x86-64 assembly
+#include <sys/rseq.h>
+#else
+#define PERCPU_RSEQ 0
+#endif
+
+#ifndef MAX_ARENAS
+#define MAX_ARENAS 64                               //upper bound for MALLOC_3_ARENAS
+#endif
+#ifndef ARENA_REGION_SIZE
+#define ARENA_REGION_SIZE ((size_t)1<<26)           //address space reserved for every arena but the main one
+#endif
+#define REMOTE_FREE_KEY block_key(0x72656d6f746521ULL)
+
+#ifndef LOCKFREE_LISTS
+#define LOCKFREE_LISTS 0                            //1: freed small heap blocks wait on lock-free stacks, one per size class
+#endif
+#define LOCKFREE_MAX_SIZE 256
+#define LOCKFREE_CLASS_STEP 16
+#define NUM_LOCKFREE_CLASSES (LOCKFREE_MAX_SIZE/LOCKFREE_CLASS_STEP)
+#ifndef LOCKFREE_COUNT
+#define LOCKFREE_COUNT 1024                         //blocks a stack holds (about) at most, more go back to their arena
+#endif
+#define LOCKFREE_TAG_SHIFT 48                       //user addresses fit in 48 bits, the tag takes the 16 above them
+#define LOCKFREE_KEY block_key(0x6c6f636b667265ULL)
+
+#ifndef MAINTENANCE_THREAD
+#define MAINTENANCE_THREAD 0                        //1: a background thread does the housekeeping below
+#endif
+#define MAINTENANCE_INTERVAL_MS 100                 //how often it wakes, MALLOC_3_MAINTENANCE_MS overrides it
+#define MAINTENANCE_BUDGET_US 1000                  //CPU time it may use per wake, MALLOC_3_MAINTENANCE_BUDGET_US
+#define TRIM_THRESHOLD (128*1024)                   //a free wilderness block at least this big gives its pages back
+
+#ifndef LOCK_MAX_SPINS
+#define LOCK_MAX_SPINS 1000                         //a contended acquire never spins longer than this before it sleeps
+#endif
+#define LOCK_MIN_SPINS 10
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+//the program break moves by multiples of HEAP_CHUNK_SIZE (e.g. 128*1024). 0 moves it by exactly
+//what is needed, the assignment tests expect the next block to start at sbrk(0)
+#ifndef HEAP_CHUNK_SIZE
+#define HEAP_CHUNK_SIZE 0
+#endif
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128*1024)                   //bigger requests get a mapping of their own
+#endif
+#define MMAP_PAGE_SIZE 4096
+#ifndef STREAM_THRESHOLD
+#define STREAM_THRESHOLD (2*1024*1024)              //realloc copies and calloc fills this big bypass the caches
+#endif
+#ifndef REALLOC_SLACK
+#define REALLOC_SLACK 0                             //1: a block realloc keeps growing gets room to grow in place
+#endif
+#define GROWTH_SLOTS 8                              //blocks an arena watches
+#define GROWTH_STREAK 2                             //growths in a row before a block gets slack
+#define GROWTH_MIN_SIZE (2*TCACHE_MAX_SIZE)         //no cache or lock-free stack holds blocks this big
 #define CANT_HELP_FRIEND -1
 #define HELPED_FRIEND -2
 #define HELPED_FRIEND_WITH_EXTRA -3
 
+#define SEGREGATED_FIT 0                            //size class lists, first fit inside the request's class
+#define TLSF_FIT 1                                  //two level segregated fit, O(1) search with bitmaps
+#define BEST_FIT 2                                  //tree of free blocks by (size, address), O(log n) search
+#ifndef FIT_POLICY
+#define FIT_POLICY SEGREGATED_FIT
+#endif
+
+#ifndef COMPACT_HEADER
+#define COMPACT_HEADER 0                            //1: 16 bytes meta_data, flags packed in the size (needs BOUNDARY_TAGS)
+#endif
+#ifndef BOUNDARY_TAGS
+#define BOUNDARY_TAGS COMPACT_HEADER                //1: no list pointers, neighbours found from sizes and footers
+#endif
+#if COMPACT_HEADER && !BOUNDARY_TAGS
+#error "COMPACT_HEADER needs BOUNDARY_TAGS"
+#endif
+#if COMPACT_HEADER
+#define MIN_BLOCK_SIZE (3*sizeof(size_t))           //a free block must have room for its free links and footer
+#define FREE_BIT 1
+#define PREV_FREE_BIT 2
+#define FLAG_BITS (FREE_BIT|PREV_FREE_BIT)          //sizes are 4 bytes aligned, the two low bits are ours
+#define CHECK_MAGIC 0x6d616c6c6f635f33ULL
+#elif BOUNDARY_TAGS
+#define MIN_BLOCK_SIZE (3*sizeof(size_t))           //a free block must have room for its free links and footer
+#else
+#define MIN_BLOCK_SIZE 4
+#endif
+
+#define SMALL_CLASS_LIMIT 256                       //sizes below this get an exact size class (4 bytes apart)
+#define NUM_SMALL_CLASSES (SMALL_CLASS_LIMIT/4)
+#define NUM_LARGE_CLASSES 20                        //power of two ranges: [256,512) ... [2^27,...)
+#define NUM_SIZE_CLASSES (NUM_SMALL_CLASSES+NUM_LARGE_CLASSES)
+
+#ifndef SLAB_ALLOCATOR
+#define SLAB_ALLOCATOR 0                            //1: requests up to SLAB_MAX_SIZE are served from page sized slabs
+#endif
+#ifndef SLAB_REGION_SIZE
+#define SLAB_REGION_SIZE ((size_t)1<<28)            //address space reserved for slabs, a page is backed only once used
+#endif
+#define SLAB_MAX_SIZE 256
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_OBJECT_ALIGN 16                        //slab size classes are 16 bytes apart
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE/SLAB_OBJECT_ALIGN)
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_SIZE/SLAB_OBJECT_ALIGN/64)
+#define SLAB_MAGIC 0x736c6162UL
+
+#define SL_INDEX_COUNT_LOG2 5                       //TLSF: every first level range is split to 32 lists
+#define SL_INDEX_COUNT (1<<SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2+2)      //first level 0 is [0,128) in 4 bytes steps
+#define FL_INDEX_MAX 28                             //2^28 > MAX_SIZE, bigger combined blocks go to the last list
+#define FL_INDEX_COUNT (FL_INDEX_MAX-FL_INDEX_SHIFT+1)
+#define SMALL_BLOCK_SIZE (1<<FL_INDEX_SHIFT)
 
+
+/*
+ *   With BOUNDARY_TAGS the fields before the free links are the whole header and the data starts right
+ *   after them: the free links are the first bytes of the data, so they exist only while the block is free.
+ */
+#if COMPACT_HEADER
+
+/*
+ *   Only size_and_flags and check are a header.
+ */
+struct meta_data{
+    size_t size_and_flags;          //block size | FREE_BIT | PREV_FREE_BIT
+    size_t check;                   //address of the header ^ CHECK_MAGIC, 0 once the header is absorbed
+#else
 struct meta_data{
     bool is_free;
+#if BOUNDARY_TAGS
+    bool prev_is_free;              //the block right before us is free, its size is in the footer right before us
+#endif
     size_t block_size;
 //    size_t current_size;
     void* start_of_alloc;
+#if !BOUNDARY_TAGS
     meta_data* next_ptr;
     meta_data* prev_ptr;
+#endif
+#endif
+#if FIT_POLICY==BEST_FIT
+    meta_data* left_free;           //children in the free blocks tree, used only while is_free
+    meta_data* right_free;
+#else
+    meta_data* next_free;           //links in the size class free list, used only while is_free
+    meta_data* prev_free;
+#endif
 };
 
+#if FIT_POLICY==BEST_FIT
+#define FIRST_FREE_LINK left_free
+#else
+#define FIRST_FREE_LINK next_free
+#endif
+#if BOUNDARY_TAGS
+#define ALIGNED_META_DATA offsetof(meta_data,FIRST_FREE_LINK)     //16 bytes compact, 24 otherwise
+#else
 #define ALIGNED_META_DATA ((sizeof(meta_data)%4==0) ?\
                     sizeof(meta_data) : sizeof(meta_data)+ALIGN_SIZE(sizeof(meta_data)))
-meta_data* first_data = NULL;
-meta_data* last_data = NULL;
+#endif
+size_t num_syscalls = 0;                            //sbrk, mmap and munmap calls made so far
+size_t key_salt=0;                                  //random, the same for the whole process
+
+
+/*
+ *   tag mixed with the random bytes the kernel gives every process (AT_RANDOM), so a program can't
+ *   leave a key in a block's data on purpose, and data that matches it by chance is as likely as a guess.
+ *   Threads that race to set the salt all read the same bytes.
+ */
+size_t block_key(size_t tag){
+    size_t salt=__atomic_load_n(&key_salt,__ATOMIC_RELAXED);
+    if(salt==0){
+        void* random=(void*)getauxval(AT_RANDOM);
+        if(random!=NULL)
+            std::memcpy(&salt,random,sizeof(salt));
+        salt^=(size_t)&key_salt;                    //ASLR, if the kernel gave nothing
+        if(salt==0)
+            salt=1;
+        __atomic_store_n(&key_salt,salt,__ATOMIC_RELAXED);
+    }
+    return tag ^ salt;
+}
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Statistics Counters--------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   The statistics are not counted by walking the heap. Every thread adds what it changes to counters
+ *   of its own (a cache line each, so threads don't share lines), and a query sums the counters of all
+ *   the threads. A thread's counters may go negative, e.g. when it frees blocks other threads allocated.
+ *   Every change is made under some allocator lock, and a thread's sequence is odd while it holds one,
+ *   so a query retries a thread that is in the middle of an operation instead of seeing half of it.
+ *   Sequences only grow, so a query that sums them again after summing the counters knows whether some
+ *   thread changed its counters during the pass: then it sums again, up to STATS_PASSES times.
+ *   If every pass saw a change (threads that never pause), the last one is returned: its totals may mix
+ *   counters from different moments, and one that comes out negative is reported as 0.
+ *   Queries take no lock and never make an allocating thread wait.
+ */
+#define STATS_LINE 64
+#define STATS_STATIC_SLOTS 64                       //more threads get slots from pages mapped on demand
+#define STATS_PAGE_SLOTS (4096/STATS_LINE)
+#define STATS_PASSES 4                              //sums of all the counters a query makes at most
+
+struct alignas(STATS_LINE) stats_counters{
+    size_t sequence;                //odd while the thread holds a lock
+    long free_blocks;
+    long free_bytes;
+    long allocated_blocks;
+    long allocated_bytes;
+    long meta_data_bytes;
+    stats_counters* next_counters;  //every thread's counters, newest first
+    stats_counters* next_unused;    //slots of threads that exited, a new thread takes one over
+};
+
+stats_counters stats_slots[STATS_STATIC_SLOTS];
+stats_counters* stats_page=NULL;                    //where slots past the static ones are carved
+int stats_used_slots=0;                             //of stats_slots, then of stats_page
+stats_counters* all_stats=NULL;
+stats_counters* unused_stats=NULL;
+pthread_mutex_t stats_slots_mutex=PTHREAD_MUTEX_INITIALIZER;   //an allocator_lock would count itself
+
+__thread stats_counters* thread_stats=NULL;
+__thread int locks_held=0;
+
+
+void count_syscall();
+void watch_thread_exit();
+
+/*
+ *   The slot of a thread that exited goes to the next new thread as it is: the counts in it are changes
+ *   the dead thread made, they stay part of the totals and the new thread keeps adding to them.
+ */
+stats_counters* new_thread_stats(){
+    watch_thread_exit();
+    pthread_mutex_lock(&stats_slots_mutex);
+    stats_counters* slot=NULL;
+    if(unused_stats!=NULL){
+        slot=unused_stats;
+        unused_stats=slot->next_unused;
+        pthread_mutex_unlock(&stats_slots_mutex);
+        return slot;
+    }
+    if(stats_page==NULL && stats_used_slots<STATS_STATIC_SLOTS){
+        slot=&stats_slots[stats_used_slots++];
+    }else{
+        if(stats_page==NULL || stats_used_slots==STATS_PAGE_SLOTS){
+            void* page=mmap(NULL,STATS_PAGE_SLOTS*sizeof(stats_counters),PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+            count_syscall();
+            if(page!=MAP_FAILED){
+                stats_page=(stats_counters*)page;
+                stats_used_slots=0;
+            }
+        }
+        if(stats_page!=NULL && stats_used_slots<STATS_PAGE_SLOTS)
+            slot=&stats_page[stats_used_slots++];
+    }
+    if(slot!=NULL){
+        slot->next_counters=all_stats;
+        __atomic_store_n(&all_stats,slot,__ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&stats_slots_mutex);
+    return slot;
+}
+
+stats_counters* get_thread_stats(){
+    if(thread_stats==NULL)
+        thread_stats=new_thread_stats();
+    return thread_stats;
+}
+
+/*
+ *   Called when the thread exits, with no lock held.
+ */
+void release_thread_stats(){
+    if(thread_stats==NULL)
+        return;
+    pthread_mutex_lock(&stats_slots_mutex);
+    thread_stats->next_unused=unused_stats;
+    unused_stats=thread_stats;
+    pthread_mutex_unlock(&stats_slots_mutex);
+    thread_stats=NULL;
+}
+
+void bump_stats_sequence(){
+    stats_counters* counters=get_thread_stats();
+    if(counters!=NULL)
+        __atomic_store_n(&counters->sequence,counters->sequence+1,__ATOMIC_RELEASE);
+}
+
+/*
+ *   Called when the thread takes a lock, and when it releases one. Only the outermost lock counts.
+ */
+void stats_begin(){
+    if(locks_held++==0){
+        bump_stats_sequence();
+        __atomic_thread_fence(__ATOMIC_RELEASE);     //the sequence is odd before any counter changes
+    }
+}
+
+void stats_end(){
+    if(--locks_held==0)
+        bump_stats_sequence();
+}
+
+void add_counter(long* counter, long delta){
+    __atomic_store_n(counter,*counter+delta,__ATOMIC_RELAXED);     //only the owner thread writes it
+}
+
+/*
+ *   Blocks (with their data and meta_data bytes) that appeared or disappeared, negative when they disappear.
+ */
+void count_blocks(long num_blocks, long bytes, long meta_data_bytes){
+    stats_counters* counters=get_thread_stats();
+    if(counters==NULL)
+        return;
+    add_counter(&counters->allocated_blocks,num_blocks);
+    add_counter(&counters->allocated_bytes,bytes);
+    add_counter(&counters->meta_data_bytes,meta_data_bytes);
+}
+
+void count_free_blocks(long num_blocks, long bytes){
+    stats_counters* counters=get_thread_stats();
+    if(counters==NULL)
+        return;
+    add_counter(&counters->free_blocks,num_blocks);
+    add_counter(&counters->free_bytes,bytes);
+}
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Locks----------------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   There is no global lock. Every arena, the list of mapped blocks, and (with SLAB_ALLOCATOR)
+ *   every slab size class and the pool of slab pages each have a lock of their own.
+ *   A lock counts how many times it was taken, and how many of those it was already held by
+ *   another thread (the counters are written only while the lock is held, with relaxed atomic stores
+ *   since any thread may read them).
+ *
+ *   The critical sections are short (a split, a combine, a list push), so a waiter that goes to sleep
+ *   at once pays more for the wake up than for the wait. A contended acquire spins first, with pause,
+ *   and sleeps in a futex only if the lock is still held after spin_limit tries.
+ *   spin_limit follows what the lock needed lately: every contended acquire moves it an eighth of the way
+ *   to the spins it took (LOCK_MAX_SPINS if spinning wasn't enough), like glibc's adaptive mutexes.
+ *   state is Drepper's futex mutex: 0 free, 1 held, 2 held and a thread may be asleep on it,
+ *   so the release makes a futex call only when a thread may be waiting. A zero filled lock is free.
+ *   Contended acquires also count how long they waited and how many of them slept.
+ */
+struct allocator_lock{
+    int state;
+    int spin_limit;
+    size_t acquisitions;
+    size_t contentions;
+    size_t sleeps;                  //contended acquires that had to sleep in the futex
+    size_t wait_ns;                 //time the contended acquires waited, and the longest wait
+    size_t max_wait_ns;
+};
+
+#define ALLOCATOR_LOCK_INITIALIZER {0,0,0,0,0,0,0}
+#define LOCK_HEAP 0                                 //which locks _num_lock_acquisitions/_num_lock_contentions count
+#define LOCK_MMAP 1
+#define LOCK_SLAB 2
+
+allocator_lock mmap_lock=ALLOCATOR_LOCK_INITIALIZER;   //the list of mapped blocks
+
+
+long lock_clock_ns(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000L+ts.tv_nsec;
+}
+
+void add_lock_counter(size_t* counter, size_t delta){
+    __atomic_store_n(counter,*counter+delta,__ATOMIC_RELAXED);     //only the holder writes it
+}
+
+bool lock_take_free(allocator_lock* lock){
+    int expected=0;
+    return __atomic_compare_exchange_n(&lock->state,&expected,1,false,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED);
+}
+
+void lock_acquire(allocator_lock* lock){
+    if(!lock_take_free(lock)){
+        long start=lock_clock_ns();
+        int limit=__atomic_load_n(&lock->spin_limit,__ATOMIC_RELAXED)*2+LOCK_MIN_SPINS;
+        if(limit>LOCK_MAX_SPINS)
+            limit=LOCK_MAX_SPINS;
+
+        int spins=0;
+        bool taken=false;
+        while(spins<limit && !taken){
+            CPU_RELAX();
+            spins++;
+            taken=__atomic_load_n(&lock->state,__ATOMIC_RELAXED)==0 && lock_take_free(lock);
+        }
+
+        bool slept=false;
+        if(!taken){
+            spins=LOCK_MAX_SPINS;
+            while(__atomic_exchange_n(&lock->state,2,__ATOMIC_ACQUIRE)!=0){
+                syscall(SYS_futex,&lock->state,FUTEX_WAIT_PRIVATE,2,NULL,NULL,0);
+                slept=true;
+            }
+        }
+
+        long waited=lock_clock_ns()-start;
+        __atomic_store_n(&lock->spin_limit,lock->spin_limit+(spins-lock->spin_limit)/8,__ATOMIC_RELAXED);
+        add_lock_counter(&lock->contentions,1);
+        add_lock_counter(&lock->sleeps,slept);
+        add_lock_counter(&lock->wait_ns,waited);
+        if((size_t)waited>lock->max_wait_ns)
+            __atomic_store_n(&lock->max_wait_ns,(size_t)waited,__ATOMIC_RELAXED);
+    }
+    add_lock_counter(&lock->acquisitions,1);
+    stats_begin();
+}
+
+/*
+ *   Takes the lock only if nobody holds it.
+ */
+bool lock_try(allocator_lock* lock){
+    if(!lock_take_free(lock))
+        return false;
+    add_lock_counter(&lock->acquisitions,1);
+    stats_begin();
+    return true;
+}
+
+void lock_release(allocator_lock* lock){
+    stats_end();
+    if(__atomic_fetch_sub(&lock->state,1,__ATOMIC_RELEASE)!=1){     //it was 2, someone may sleep
+        __atomic_store_n(&lock->state,0,__ATOMIC_RELEASE);
+        syscall(SYS_futex,&lock->state,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+    }
+}
+
+void count_syscall(){
+    __atomic_fetch_add(&num_syscalls,1,__ATOMIC_RELAXED);    //made under different locks
+}
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Arenas---------------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   An arena is a heap of its own: block list, free lists, wilderness and lock.
+ *   The main arena grows with sbrk, the others carve blocks out of a region reserved with mmap
+ *   (the arena struct sits at the start of its region).
+ *   The heap functions below work on current_arena, the last arena this thread locked,
+ *   through the names they had when there was one heap (first_data, last_data, ...).
+ */
+#if REALLOC_SLACK
+struct growth_slot{
+    meta_data* block;               //NULL if the slot is empty
+    size_t requested;               //size of the last realloc, the bytes of the block in use
+    size_t grows;                   //growths in a row
+    bool slack;                     //the block was left bigger than requested
+};
+#endif
+
+struct arena{
+    allocator_lock lock;
+    meta_data* first;               //first_data
+    meta_data* last;                //last_data
+    char* start;                    //blocks live in [start, top)
+    char* top;                      //heap_top: end of last_data, blocks are carved from [top, end)
+    char* end;                      //heap_end: the program break as we left it, or the end of the region
+#if FIT_POLICY==BEST_FIT
+    meta_data* free_tree;
+#elif FIT_POLICY==TLSF_FIT
+    unsigned int fl_bitmap;         //bit fl is on if any list in sl_bitmap[fl] is not empty
+    unsigned int sl_bitmap[FL_INDEX_COUNT];
+    meta_data* free_lists[FL_INDEX_COUNT][SL_INDEX_COUNT];
+#else
+    meta_data* free_lists[NUM_SIZE_CLASSES];
+#endif
+    size_t num_threads;             //threads assigned to the arena, under arenas_lock
+    void* remote_frees;             //blocks other threads freed, pushed without the lock
+    bool orphaned;                  //its last thread exited, under arenas_lock
+#if MAINTENANCE_THREAD
+    meta_data* trimmed;             //the wilderness block the last trim gave back, and its size then
+    size_t trimmed_size;
+    char* trimmed_zero;             //its data is zero from here to its footer
+#endif
+#if REALLOC_SLACK
+    growth_slot growth_slots[GROWTH_SLOTS];     //blocks realloc is growing (see Realloc Slack)
+    size_t growth_victim;           //the slot the next new block takes
+#endif
+};
+
+#define ARENA_HEADER_SIZE ((sizeof(arena)+15)/16*16)
+
+arena main_arena={};                                //all zero, the lock too (see ALLOCATOR_LOCK_INITIALIZER)
+arena* arenas[MAX_ARENAS]={&main_arena};
+int num_arenas=1;
+int num_orphans=0;                                  //arenas that had threads and have none left
+int arena_limit=0;                                  //MALLOC_3_ARENAS, or the number of CPUs
+allocator_lock arenas_lock=ALLOCATOR_LOCK_INITIALIZER;  //creating arenas and assigning threads to them
+
+__thread arena* current_arena=&main_arena;
+__thread arena* thread_arena=NULL;                  //where this thread allocates
+__thread bool thread_exited=false;                  //its exit destructor ran, it has no thread cache any more
+__thread bool exit_watched=false;                   //the exit destructor is set for this thread
+__thread void* zeroed_block=NULL;                   //the last block handed out whose data is (partly) known zero
+__thread size_t zeroed_from=0;                      //its bytes from here on are zero, calloc skips them
+
+#define first_data (current_arena->first)
+#define last_data (current_arena->last)
+#define heap_top (current_arena->top)
+#define heap_end (current_arena->end)
+#if FIT_POLICY==BEST_FIT
+#define free_tree (current_arena->free_tree)
+#elif FIT_POLICY==TLSF_FIT
+#define fl_bitmap (current_arena->fl_bitmap)
+#define sl_bitmap (current_arena->sl_bitmap)
+#define free_lists (current_arena->free_lists)
+#else
+#define free_lists (current_arena->free_lists)
+#endif
+
+
+void lock_arena(arena* locked){
+    lock_acquire(&locked->lock);
+    current_arena=locked;
+}
+
+bool try_lock_arena(arena* locked){
+    if(!lock_try(&locked->lock))
+        return false;
+    current_arena=locked;
+    return true;
+}
+
+void unlock_arena(arena* locked){
+    lock_release(&locked->lock);
+}
+
+arena* new_arena(){
+    void* region=mmap(NULL,ARENA_REGION_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    count_syscall();
+    if(region==MAP_FAILED)
+        return NULL;
+
+    arena* created=(arena*)region;                      //the mapping is zero filled, so are the lists and the lock
+    created->start=(char*)region+ARENA_HEADER_SIZE;
+    created->top=created->start;
+    created->end=(char*)region+ARENA_REGION_SIZE;
+    return created;
+}
+
+/*
+ *   The first thread gets the main arena. Every other thread gets the arena with the fewest threads,
+ *   a new one is made while there are fewer than arena_limit and all of them have a thread.
+ */
+arena* assign_arena(){
+    lock_acquire(&arenas_lock);
+    if(arena_limit==0){
+        char* env=getenv("MALLOC_3_ARENAS");
+        arena_limit=env!=NULL ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if(arena_limit<1)
+            arena_limit=1;
+        if(arena_limit>MAX_ARENAS)
+            arena_limit=MAX_ARENAS;
+    }
+
+    arena* least_loaded=arenas[0];
+    for(int index=1; index<num_arenas; index++){
+        if(arenas[index]->num_threads<least_loaded->num_threads)
+            least_loaded=arenas[index];
+    }
+    if(least_loaded->num_threads>0 && num_arenas<arena_limit){
+        arena* created=new_arena();
+        if(created!=NULL){
+            arenas[num_arenas]=created;
+            __atomic_store_n(&num_arenas,num_arenas+1,__ATOMIC_RELEASE);   //find_arena reads it without the lock
+            least_loaded=created;
+        }
+    }
+    if(least_loaded->num_threads++==0 && least_loaded->orphaned){
+        least_loaded->orphaned=false;
+        __atomic_store_n(&num_orphans,num_orphans-1,__ATOMIC_RELAXED);
+    }
+    lock_release(&arenas_lock);
+
+    thread_arena=least_loaded;
+    return least_loaded;
+}
+
+/*
+ *   The exiting thread leaves its arena (thread_arena still points to it, in case it allocates again
+ *   before it is gone). Returns true if the arena has no threads left: it is an orphan, new threads
+ *   get it first (it has the fewest threads), and until then other threads take free blocks from it.
+ */
+bool leave_arena(){
+    if(thread_arena==NULL)
+        return false;
+
+    lock_acquire(&arenas_lock);
+    bool orphaned=--thread_arena->num_threads==0;
+    if(orphaned){
+        thread_arena->orphaned=true;
+        __atomic_store_n(&num_orphans,num_orphans+1,__ATOMIC_RELAXED);
+    }
+    lock_release(&arenas_lock);
+    return orphaned;
+}
+
+void watch_fork();
+#if MAINTENANCE_THREAD
+void start_maintenance();
+#endif
+
+arena* get_thread_arena(){
+    if(thread_arena==NULL){
+        assign_arena();
+        watch_fork();
+#if MAINTENANCE_THREAD
+        start_maintenance();                            //once per thread, not on every malloc. pthread_create
+#endif                                                  //allocates, so the thread has its arena by then
+    }
+    return thread_arena;
+}
+
+/*
+ *   The arena whose blocks area holds user_ptr, NULL if none. No lock is needed:
+ *   arenas are never removed and an arena's heap only grows.
+ */
+arena* find_arena(void* user_ptr){
+    int count=__atomic_load_n(&num_arenas,__ATOMIC_ACQUIRE);
+    for(int index=0; index<count; index++){
+        arena* candidate=arenas[index];
+        char* start=__atomic_load_n(&candidate->start,__ATOMIC_ACQUIRE);
+        if(start!=NULL && (char*)user_ptr>=start && (char*)user_ptr<__atomic_load_n(&candidate->top,__ATOMIC_ACQUIRE))
+            return candidate;
+    }
+    return NULL;
+}
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Header Fields--------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+#if COMPACT_HEADER
+
+size_t get_block_size(meta_data* block){
+    return block->size_and_flags & ~(size_t)FLAG_BITS;
+}
+
+void set_block_size(meta_data* block, size_t size){
+    block->size_and_flags=size | (block->size_and_flags & FLAG_BITS);
+}
+
+bool is_block_free(meta_data* block){
+    return (block->size_and_flags & FREE_BIT)!=0;
+}
+
+void set_free_bit(meta_data* block, bool is_free){
+    if(is_free)
+        block->size_and_flags|=FREE_BIT;
+    else
+        block->size_and_flags&=~(size_t)FREE_BIT;
+}
+
+bool is_prev_free(meta_data* block){
+    return (block->size_and_flags & PREV_FREE_BIT)!=0;
+}
+
+void set_prev_free(meta_data* block, bool prev_is_free){
+    if(prev_is_free)
+        block->size_and_flags|=PREV_FREE_BIT;
+    else
+        block->size_and_flags&=~(size_t)PREV_FREE_BIT;
+}
+
+void* get_start_of_alloc(meta_data* block){
+    return (char*)block+ALIGNED_META_DATA;
+}
+
+/*
+ *   A new header at this address, in use, previous block in use.
+ */
+void init_block(meta_data* block, size_t size){
+    block->size_and_flags=size;
+    block->check=(size_t)block ^ CHECK_MAGIC;
+}
+
+void clear_block(meta_data* block){
+    block->check=0;
+}
+
+bool is_valid_block(meta_data* block){
+    return block->check==((size_t)block ^ CHECK_MAGIC);
+}
+
+#else
+
+size_t get_block_size(meta_data* block){
+    return block->block_size;
+}
+
+void set_block_size(meta_data* block, size_t size){
+    block->block_size=size;
+}
+
+bool is_block_free(meta_data* block){
+    return block->is_free;
+}
+
+void set_free_bit(meta_data* block, bool is_free){
+    block->is_free=is_free;
+}
+
+#if BOUNDARY_TAGS
+bool is_prev_free(meta_data* block){
+    return block->prev_is_free;
+}
+
+void set_prev_free(meta_data* block, bool prev_is_free){
+    block->prev_is_free=prev_is_free;
+}
+#endif
+
+void* get_start_of_alloc(meta_data* block){
+    return block->start_of_alloc;
+}
+
+void init_block(meta_data* block, size_t size){
+    block->is_free=false;
+#if BOUNDARY_TAGS
+    block->prev_is_free=false;
+#endif
+    block->block_size=size;
+    block->start_of_alloc=(char*)block+ALIGNED_META_DATA;
+}
+
+/*
+ *   Called on headers swallowed by a combine, so a stale user pointer can't find them.
+ */
+void clear_block(meta_data* block){
+    block->start_of_alloc=NULL;
+}
+
+bool is_valid_block(meta_data* block){
+    return block->start_of_alloc==(char*)block+ALIGNED_META_DATA;
+}
+
+#endif
+
+/*
+ *   Where the data of block is known to be zero from (up to its footer), NULL if it isn't.
+ *   Only a trimmed free block that stayed in its free list since is.
+ */
+char* trimmed_zero(meta_data* block){
+#if MAINTENANCE_THREAD
+    if(current_arena->trimmed==block && current_arena->trimmed_size==get_block_size(block))
+        return current_arena->trimmed_zero;
+#else
+    (void)block;
+#endif
+    return NULL;
+}
+
+void set_trimmed(meta_data* block, char* zero){
+#if MAINTENANCE_THREAD
+    current_arena->trimmed=block;
+    current_arena->trimmed_size=get_block_size(block);
+    current_arena->trimmed_zero=zero;
+#else
+    (void)block;
+    (void)zero;
+#endif
+}
+
+/*
+ *   block leaves its free list, so whatever the last trim knew about its data is stale.
+ */
+void forget_trim(meta_data* block){
+#if MAINTENANCE_THREAD
+    if(current_arena->trimmed==block)
+        current_arena->trimmed=NULL;
+#else
+    (void)block;
+#endif
+}
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Free Lists-----------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+#if FIT_POLICY==BEST_FIT
+
+/*
+ *   Treap: ordered by (block_size, address), heap ordered by a hash of the address,
+ *   so it stays balanced (expected) without storing anything more than the two children.
+ */
+bool tree_less(meta_data* a, meta_data* b){
+    return get_block_size(a)<get_block_size(b) || (get_block_size(a)==get_block_size(b) && a<b);
+}
+
+size_t tree_priority(meta_data* block){
+    size_t hash=(size_t)block;
+    hash^=hash>>33;
+    hash*=0xff51afd7ed558ccdULL;
+    hash^=hash>>33;
+    return hash;
+}
+
+meta_data* tree_insert(meta_data* root, meta_data* block){
+    if(root==NULL)
+        return block;
+
+    if(tree_less(block,root)){
+        root->left_free=tree_insert(root->left_free,block);
+        if(tree_priority(root->left_free)>tree_priority(root)){        //rotate right
+            meta_data* left=root->left_free;
+            root->left_free=left->right_free;
+            left->right_free=root;
+            return left;
+        }
+    }else{
+        root->right_free=tree_insert(root->right_free,block);
+        if(tree_priority(root->right_free)>tree_priority(root)){       //rotate left
+            meta_data* right=root->right_free;
+            root->right_free=right->left_free;
+            right->left_free=root;
+            return right;
+        }
+    }
+    return root;
+}
+
+/*
+ *   Joins two trees where every block of left is smaller than every block of right.
+ */
+meta_data* tree_join(meta_data* left, meta_data* right){
+    if(left==NULL)
+        return right;
+    if(right==NULL)
+        return left;
+
+    if(tree_priority(left)>tree_priority(right)){
+        left->right_free=tree_join(left->right_free,right);
+        return left;
+    }
+    right->left_free=tree_join(left,right->left_free);
+    return right;
+}
+
+meta_data* tree_remove(meta_data* root, meta_data* block){
+    if(root==block)
+        return tree_join(block->left_free,block->right_free);
+
+    if(tree_less(block,root))
+        root->left_free=tree_remove(root->left_free,block);
+    else
+        root->right_free=tree_remove(root->right_free,block);
+    return root;
+}
+
+void insert_free_block(meta_data* block){
+    count_free_blocks(1,get_block_size(block));
+    block->left_free=NULL;
+    block->right_free=NULL;
+    free_tree=tree_insert(free_tree,block);
+}
+
+void remove_free_block(meta_data* block){
+    forget_trim(block);
+    count_free_blocks(-1,-(long)get_block_size(block));
+    free_tree=tree_remove(free_tree,block);
+    block->left_free=NULL;
+    block->right_free=NULL;
+}
+
+/*
+ *   Returns the smallest free block of at least size bytes (lowest address on ties), or NULL.
+ */
+meta_data* find_free_block(size_t size){
+    meta_data* best=NULL;
+    meta_data* current=free_tree;
+    while(current){
+        if(get_block_size(current)>=size){
+            best=current;
+            current=current->left_free;
+        }else{
+            current=current->right_free;
+        }
+    }
+    return best;
+}
+
+#else
+
+void push_free_list(meta_data** head, meta_data* block){
+    block->prev_free=NULL;
+    block->next_free=*head;
+    if(*head!=NULL)
+        (*head)->prev_free=block;
+    *head=block;
+}
+
+void unlink_free_list(meta_data** head, meta_data* block){
+    if(block->prev_free!=NULL)
+        block->prev_free->next_free=block->next_free;
+    else
+        *head=block->next_free;
+
+    if(block->next_free!=NULL)
+        block->next_free->prev_free=block->prev_free;
+
+    block->next_free=NULL;
+    block->prev_free=NULL;
+}
+
+#if FIT_POLICY==TLSF_FIT
+
+/*
+ *   First level is the power of two of the size, second level splits it linearly.
+ *   Sizes below SMALL_BLOCK_SIZE all go to first level 0, 4 bytes apart.
+ */
+void mapping_insert(size_t size, int* fl, int* sl){
+    if(size<SMALL_BLOCK_SIZE){
+        *fl=0;
+        *sl=(int)(size/4);
+        return;
+    }
+
+    int msb=63-__builtin_clzll(size);
+    if(msb>=FL_INDEX_MAX){                          //only combined blocks get here, bigger than any request
+        *fl=FL_INDEX_COUNT-1;
+        *sl=SL_INDEX_COUNT-1;
+        return;
+    }
+    *sl=(int)(size>>(msb-SL_INDEX_COUNT_LOG2))^SL_INDEX_COUNT;
+    *fl=msb-FL_INDEX_SHIFT+1;
+}
+
+/*
+ *   Rounds size up to the next list, so every block in the list we find is big enough.
+ */
+void mapping_search(size_t size, int* fl, int* sl){
+    if(size>=SMALL_BLOCK_SIZE){
+        int msb=63-__builtin_clzll(size);
+        size+=((size_t)1<<(msb-SL_INDEX_COUNT_LOG2))-1;
+    }
+    mapping_insert(size,fl,sl);
+}
+
+void insert_free_block(meta_data* block){
+    count_free_blocks(1,get_block_size(block));
+    int fl, sl;
+    mapping_insert(get_block_size(block),&fl,&sl);
+    push_free_list(&free_lists[fl][sl],block);
+    fl_bitmap|=(1U<<fl);
+    sl_bitmap[fl]|=(1U<<sl);
+}
+
+void remove_free_block(meta_data* block){
+    forget_trim(block);
+    count_free_blocks(-1,-(long)get_block_size(block));
+    int fl, sl;
+    mapping_insert(get_block_size(block),&fl,&sl);
+    unlink_free_list(&free_lists[fl][sl],block);
+    if(free_lists[fl][sl]==NULL){
+        sl_bitmap[fl]&=~(1U<<sl);
+        if(sl_bitmap[fl]==0)
+            fl_bitmap&=~(1U<<fl);
+    }
+}
+
+/*
+ *   Returns a free block of at least size bytes (still in its list), or NULL.
+ *   Two bitmap lookups, no list is walked.
+ */
+meta_data* find_free_block(size_t size){
+    int fl, sl;
+    mapping_search(size,&fl,&sl);
+    if(fl>=FL_INDEX_COUNT)
+        return NULL;
+
+    unsigned int sl_map=sl_bitmap[fl] & (~0U<<sl);
+    if(sl_map==0){                                  //nothing in this first level, go to the next non empty one
+        unsigned int fl_map=fl_bitmap & (~0U<<(fl+1));
+        if(fl_map==0)
+            return NULL;
+        fl=__builtin_ctz(fl_map);
+        sl_map=sl_bitmap[fl];
+    }
+    sl=__builtin_ctz(sl_map);
+    return free_lists[fl][sl];
+}
+
+#else
+
+/*
+ *   Exact classes for small sizes, then one class per power of two.
+ *   Every block in class i (i>0) is at least as big as the lower bound of class i.
+ */
+int size_class(size_t size){
+    if(size<SMALL_CLASS_LIMIT)
+        return (int)(size/4);
+
+    int size_class=NUM_SMALL_CLASSES;
+    size>>=9;                                       //256..511 -> first large class
+    while(size && size_class<NUM_SIZE_CLASSES-1){
+        size>>=1;
+        size_class++;
+    }
+    return size_class;
+}
+
+void insert_free_block(meta_data* block){
+    count_free_blocks(1,get_block_size(block));
+    push_free_list(&free_lists[size_class(get_block_size(block))],block);
+}
+
+void remove_free_block(meta_data* block){
+    forget_trim(block);
+    count_free_blocks(-1,-(long)get_block_size(block));
+    unlink_free_list(&free_lists[size_class(get_block_size(block))],block);
+}
+
+/*
+ *   Returns a free block of at least size bytes (still in its list), or NULL.
+ *   The request's own class is searched first fit: an exact class's head always fits, a power of two
+ *   class may hold blocks smaller than size before one that fits. Only the heads of the bigger classes
+ *   are looked at, any block there fits as is.
+ */
+meta_data* find_free_block(size_t size){
+    int own=size_class(size);
+    for(meta_data* current=free_lists[own]; current; current=current->next_free){
+        if(get_block_size(current)>=size)
+            return current;
+    }
+    for(int index=own+1; index<NUM_SIZE_CLASSES; index++){
+        if(free_lists[index])
+            return free_lists[index];
+    }
+    return NULL;
+}
+
+#endif
+
+#endif
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Neighbours-----------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+#if BOUNDARY_TAGS
+
+/*
+ *   Knuth's boundary tags: a free block keeps its size in a footer (its last bytes)
+ *   and the block after it has prev_is_free on, so both neighbours come from size arithmetic.
+ */
+size_t* footer_of(meta_data* block){
+    return (size_t*)((char*)get_start_of_alloc(block)+get_block_size(block))-1;
+}
+
+meta_data* next_block(meta_data* block){
+    if(block==last_data)
+        return NULL;
+    return (meta_data*)((char*)get_start_of_alloc(block)+get_block_size(block));
+}
+
+meta_data* prev_free_block(meta_data* block){
+    if(!is_prev_free(block))
+        return NULL;
+    size_t prev_size=*((size_t*)block-1);
+    return (meta_data*)((char*)block-prev_size-ALIGNED_META_DATA);
+}
+
+void set_block_free(meta_data* block, bool is_free){
+    set_free_bit(block,is_free);
+    if(is_free)
+        *footer_of(block)=get_block_size(block);
+
+    meta_data* next=next_block(block);
+    if(next!=NULL)
+        set_prev_free(next,is_free);
+}
+
+/*
+ *   new_block was just cut from the end of current.
+ */
+void link_new_block(meta_data* current, meta_data* new_block){
+    set_prev_free(new_block,is_block_free(current));
+    if(current==last_data)
+        last_data=new_block;
+}
+
+/*
+ *   new_block replaces old_block in the same place of the heap (old_block's start moved).
+ */
+void replace_block(meta_data* old_block, meta_data* new_block){
+    set_prev_free(new_block,is_prev_free(old_block));
+    if(old_block==last_data)
+        last_data=new_block;
+}
+
+#else
+
+meta_data* next_block(meta_data* block){
+    return block->next_ptr;
+}
+
+meta_data* prev_free_block(meta_data* block){
+    if(block->prev_ptr!=NULL && is_block_free(block->prev_ptr))
+        return block->prev_ptr;
+    return NULL;
+}
+
+void set_block_free(meta_data* block, bool is_free){
+    set_free_bit(block,is_free);
+}
+
+void link_new_block(meta_data* current, meta_data* new_block){
+    new_block->next_ptr=current->next_ptr;              //updates pointers of list
+    if(current->next_ptr!=NULL)
+        current->next_ptr->prev_ptr=new_block;
+    else
+        last_data=new_block;                            //split the wilderness block
+    current->next_ptr=new_block;
+    new_block->prev_ptr=current;
+}
+
+void replace_block(meta_data* old_block, meta_data* new_block){
+    meta_data* next_ptr=old_block->next_ptr;            //old_block and new_block may overlap
+    meta_data* prev_ptr=old_block->prev_ptr;
+    new_block->next_ptr=next_ptr;
+    new_block->prev_ptr=prev_ptr;
+    if(next_ptr!=NULL)
+        next_ptr->prev_ptr=new_block;
+    else
+        last_data=new_block;
+    if(prev_ptr!=NULL)
+        prev_ptr->next_ptr=new_block;
+}
+
+#endif
+
+/*
+ *   block swallows the block right after it (meta_data included).
+ */
+void absorb_next_block(meta_data* block){
+    meta_data* next=next_block(block);
+#if !BOUNDARY_TAGS
+    block->next_ptr=next->next_ptr;
+    if(next->next_ptr!=NULL)
+        next->next_ptr->prev_ptr=block;
+#endif
+    if(next==last_data)
+        last_data=block;
+
+    set_block_size(block,get_block_size(block)+ALIGNED_META_DATA+get_block_size(next));
+    clear_block(next);                                  //absorbed header can't be found by user ptr anymore
+    count_blocks(-1,ALIGNED_META_DATA,-(long)ALIGNED_META_DATA);
+}
+
+
+
+#if REALLOC_SLACK
+void forget_growth(meta_data* block);
+#endif
+
+/*
+ *   to_release must be free and not in any free list yet.
+ *   Merges it with its free neighbours and puts the result in its free list.
+ */
+void check_and_combine(meta_data* to_release){
+#if REALLOC_SLACK
+    if(get_block_size(to_release)>=GROWTH_MIN_SIZE)     //smaller blocks never get slack
+        forget_growth(to_release);
+#endif
+    meta_data* prev=prev_free_block(to_release);
+    if(prev!=NULL){                                     //combine to_release and prev
+        remove_free_block(prev);
+        absorb_next_block(prev);
+        to_release=prev;
+    }
+
+    meta_data* next=next_block(to_release);
+    char* zero=NULL;
+    if(next!=NULL && is_block_free(next)){              //combine to_release and next
+        zero=trimmed_zero(next);
+        remove_free_block(next);
+        absorb_next_block(to_release);
+    }
+
+    set_block_free(to_release,true);
+    insert_free_block(to_release);
+    if(zero!=NULL)                                      //next's trimmed pages are untouched
+        set_trimmed(to_release,zero);
+}
+
+void check_and_split(meta_data* current, size_t size){
+    if(get_block_size(current)<(size+ALIGNED_META_DATA+LARGE_ENOUGH))
+        return;
+
+    meta_data* new_meta_data=(meta_data*)((char*)get_start_of_alloc(current)+size);   //inserts new meta_data to list
+    init_block(new_meta_data,get_block_size(current)-(size+ALIGNED_META_DATA));
+
+    set_block_size(current,size);
+    link_new_block(current,new_meta_data);
+    count_blocks(1,-(long)ALIGNED_META_DATA,ALIGNED_META_DATA);
+
+    check_and_combine(new_meta_data);
+}
+
+/*
+ *   Grows current (in use) into next (free) so current holds size bytes.
+ *   If what is left of next is big enough to be a block it stays free, otherwise it is swallowed.
+ */
+meta_data* come_to_help_a_friend(meta_data* current, meta_data* next, size_t size){
+
+    if(get_block_size(current)+get_block_size(next)+ALIGNED_META_DATA < size)
+        return NULL;                        //not enough space in current+next for requested realloc
+
+    remove_free_block(next);
+
+    size_t left_over=get_block_size(current)+ALIGNED_META_DATA+get_block_size(next)-size;
+    if(left_over<ALIGNED_META_DATA+LARGE_ENOUGH){       //merge current and next
+        absorb_next_block(current);
+        set_block_free(current,false);
+        return current;
+    }
+
+    //next now needs to give current the requested bytes, and become smaller
+    size_t next_size=get_block_size(next);
+    meta_data* old_next=next;
+    clear_block(next);                                  //old header location becomes part of current's data
+
+    next=(meta_data*)((char*)next+(size-get_block_size(current)));
+    replace_block(old_next,next);
+    init_block(next,next_size-(size-get_block_size(current)));
+    set_block_size(current,size);
+
+    set_block_free(next,true);
+    insert_free_block(next);
+    return current;
+}
+
+/*
+ *   Grows current (in use) backward into the free block before it, and also into the free block
+ *   after it when prev alone is not enough. The data is moved down to prev's start.
+ *   Returns the new block, or NULL (nothing changed) if the neighbours are too small.
+ */
+meta_data* expand_backward(meta_data* current, size_t size){
+    meta_data* prev=prev_free_block(current);
+    if(prev==NULL)
+        return NULL;
+
+    meta_data* next=next_block(current);
+    size_t available=get_block_size(prev)+ALIGNED_META_DATA+get_block_size(current);
+    bool take_next=false;
+    if(available<size){
+        if(next==NULL || !is_block_free(next) || available+ALIGNED_META_DATA+get_block_size(next)<size)
+            return NULL;
+        take_next=true;
+    }
+
+    size_t live=get_block_size(current);
+    void* old_data=get_start_of_alloc(current);
+    remove_free_block(prev);
+    if(take_next){
+        remove_free_block(next);
+        absorb_next_block(current);
+    }
+    absorb_next_block(prev);
+    set_block_free(prev,false);
+
+    std::memmove(get_start_of_alloc(prev),old_data,live);  //before the split, its header may land on the old data
+    check_and_split(prev,size);
+    return prev;
+}
+
+/*
+ *   Hands out size bytes at the end of the heap, header and data of a new block in one go.
+ *   With HEAP_CHUNK_SIZE set, the program break is moved only when the tail we reserved is used up,
+ *   and then by whole chunks, so most blocks and wilderness growths cost no syscall.
+ *   An arena other than the main one has its whole region reserved already.
+ *   Returns NULL if the heap can't grow.
+ */
+void* heap_carve(size_t size){
+    if(heap_top==NULL){
+        void* program_break=sbrk(0);
+        count_syscall();
+        heap_top=(char*)program_break;
+        if(SIZE_NOT_ALIGNED((size_t)heap_top))
+            heap_top+=ALIGN_SIZE((size_t)heap_top);
+        heap_end=(char*)program_break;
+        __atomic_store_n(&current_arena->start,heap_top,__ATOMIC_RELEASE);
+    }
+
+    if(heap_top+size>heap_end){
+        if(current_arena!=&main_arena)                  //the region is used up
+            return NULL;
+
+        size_t missing=heap_top+size-heap_end;
+        size_t growth=missing;
+#if HEAP_CHUNK_SIZE>1
+        growth=(missing+HEAP_CHUNK_SIZE-1)/HEAP_CHUNK_SIZE*HEAP_CHUNK_SIZE;
+#endif
+
+        count_syscall();
+        if(sbrk(growth)==(void*)(-1)){                  //no room for a whole chunk, try the exact amount
+            if(growth==missing)
+                return NULL;
+            growth=missing;
+            count_syscall();
+            if(sbrk(growth)==(void*)(-1))
+                return NULL;
+        }
+        heap_end+=growth;
+    }
+
+    void* carved=heap_top;
+    __atomic_store_n(&heap_top,heap_top+size,__ATOMIC_RELEASE);    //read without the lock by find_arena
+    return carved;
+}
+
+bool wilderness_expand(size_t size_differnce){
+    return heap_carve(size_differnce)!=NULL;
+}
+
+void mark_zeroed(void* start_of_alloc, size_t from){
+    zeroed_block=start_of_alloc;
+    zeroed_from=from;
+}
+
+/*
+ *   How many bytes at the start of a free block's data may be dirty, the rest is known zero.
+ *   That is all of it, unless it is trimmed (see trimmed_zero), then its footer is cleared here too.
+ *   Call it before the block is removed from its list.
+ */
+size_t dirty_bytes(meta_data* block){
+    char* zero=trimmed_zero(block);
+    if(zero==NULL)
+        return get_block_size(block);
+
+    *((size_t*)((char*)get_start_of_alloc(block)+get_block_size(block))-1)=0;
+    return zero-(char*)get_start_of_alloc(block);
+}
+
+
+
+/*
+ *   Returns NULL if there is no empty place in the list.
+ */
+meta_data* find_first_fitting_place(size_t size){
+    meta_data* current=find_free_block(size);
+    if(current){
+        char* zero=trimmed_zero(current);
+        mark_zeroed(get_start_of_alloc(current),dirty_bytes(current));
+        remove_free_block(current);
+        set_block_free(current,false);
+        check_and_split(current,size);
+        if(zero!=NULL && current!=last_data){           //the rest of the trimmed wilderness is still trimmed
+            char* rest=(char*)get_start_of_alloc(last_data)+2*sizeof(void*);
+            set_trimmed(last_data,rest>zero ? rest : zero);
+        }
+        return current;
+    }
+
+    if(last_data!=NULL && is_block_free(last_data)){    //no free block is big enough, but the wilderness is free (problem 3)
+        if(!(wilderness_expand(size-get_block_size(last_data))))
+            return NULL;
+
+        mark_zeroed(get_start_of_alloc(last_data),dirty_bytes(last_data));    //what the heap grew by is fresh
+        remove_free_block(last_data);
+        count_blocks(0,size-get_block_size(last_data),0);
+        set_block_size(last_data,size);
+        set_block_free(last_data,false);
+        return last_data;
+    }
+
+    return NULL;
+}
+
+/*
+ *   The meta_data always sits right before the user's data, so we get it by a fixed offset.
+ *   Pointers outside the heap (or not aligned) are rejected before touching any memory,
+ *   and a header is valid only if is_valid_block agrees it really sits at its address
+ *   (headers swallowed by a combine are cleared, so stale pointers are rejected too).
+ */
+meta_data* find_meta_data_by_user_ptr(void* user_ptr){
+    if(user_ptr==NULL || first_data==NULL)
+        return NULL;
+
+    if((char*)user_ptr<(char*)get_start_of_alloc(first_data) ||
+            (char*)user_ptr>(char*)get_start_of_alloc(last_data))   //not in our heap
+        return NULL;
+
+    if(SIZE_NOT_ALIGNED((size_t)user_ptr))
+        return NULL;
+
+    meta_data* current=(meta_data*)((char*)user_ptr-ALIGNED_META_DATA);
+    if(!is_valid_block(current))
+        return NULL;
+
+    return current;
+}
+
+/*
+ *   find_meta_data_by_user_ptr for callers that don't hold an arena lock. Heaps only grow,
+ *   so a pointer inside an arena with a valid header in front of it is a block,
+ *   and while it is in use nobody but its owner changes its size.
+ */
+meta_data* find_block_unlocked(void* user_ptr){
+    if(user_ptr==NULL || SIZE_NOT_ALIGNED((size_t)user_ptr) || find_arena(user_ptr)==NULL)
+        return NULL;
+
+    meta_data* current=(meta_data*)((char*)user_ptr-ALIGNED_META_DATA);
+    if(!is_valid_block(current) || is_block_free(current))
+        return NULL;
+
+    return current;
+}
+
+meta_data* create_new_meta_data(size_t size){
+    meta_data* data_to_add=(meta_data*)heap_carve(ALIGNED_META_DATA+size);
+    if(data_to_add==NULL)                               //if allocation failed we dont add data_to_add to the list
+        return NULL;
+
+    init_block(data_to_add,size);                       //initializing the mete_data fields
+    count_blocks(1,size,ALIGNED_META_DATA);
+    mark_zeroed(get_start_of_alloc(data_to_add),0);     //never used since the kernel gave it
+
+#if BOUNDARY_TAGS
+    set_prev_free(data_to_add,last_data!=NULL && is_block_free(last_data));
+    if(!first_data)
+        first_data=data_to_add;
+    last_data=data_to_add;
+#else
+    if(!first_data){
+        first_data=data_to_add;
+        last_data=data_to_add;
+        data_to_add->next_ptr=NULL;
+        data_to_add->prev_ptr=NULL;
+    }else {
+        last_data->next_ptr = data_to_add;
+        data_to_add->prev_ptr = last_data;
+        data_to_add->next_ptr = NULL;
+        last_data = data_to_add;
+    }
+#endif
+    return data_to_add;
+}
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Copy Kernels---------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   realloc copies and calloc fills of at least STREAM_THRESHOLD bytes use non-temporal stores: a block that
+ *   big would push everything else out of the caches, and its start is evicted before its end is written anyway.
+ *   The widest kernel the CPU runs is picked on first use. Smaller sizes, and other CPUs, use libc.
+ *   A kernel gets a 64 bytes aligned dst and a multiple of STREAM_STEP bytes, the callers do the edges.
+ */
+#define STREAM_STEP 256
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx512f")))
+void stream_copy_avx512(char* dst, const char* src, size_t size){
+    for(; size>0; size-=STREAM_STEP, dst+=STREAM_STEP, src+=STREAM_STEP){
+        __m512i a=_mm512_loadu_si512(src);
+        __m512i b=_mm512_loadu_si512(src+64);
+        __m512i c=_mm512_loadu_si512(src+128);
+        __m512i d=_mm512_loadu_si512(src+192);
+        _mm512_stream_si512((__m512i*)dst,a);
+        _mm512_stream_si512((__m512i*)(dst+64),b);
+        _mm512_stream_si512((__m512i*)(dst+128),c);
+        _mm512_stream_si512((__m512i*)(dst+192),d);
+    }
+}
+
+__attribute__((target("avx512f")))
+void stream_zero_avx512(char* dst, size_t size){
+    __m512i zero=_mm512_setzero_si512();
+    for(; size>0; size-=STREAM_STEP, dst+=STREAM_STEP){
+        _mm512_stream_si512((__m512i*)dst,zero);
+        _mm512_stream_si512((__m512i*)(dst+64),zero);
+        _mm512_stream_si512((__m512i*)(dst+128),zero);
+        _mm512_stream_si512((__m512i*)(dst+192),zero);
+    }
+}
+
+__attribute__((target("avx2")))
+void stream_copy_avx2(char* dst, const char* src, size_t size){
+    for(; size>0; size-=STREAM_STEP, dst+=STREAM_STEP, src+=STREAM_STEP){
+        for(int offset=0; offset<STREAM_STEP; offset+=128){
+            __m256i a=_mm256_loadu_si256((const __m256i*)(src+offset));
+            __m256i b=_mm256_loadu_si256((const __m256i*)(src+offset+32));
+            __m256i c=_mm256_loadu_si256((const __m256i*)(src+offset+64));
+            __m256i d=_mm256_loadu_si256((const __m256i*)(src+offset+96));
+            _mm256_stream_si256((__m256i*)(dst+offset),a);
+            _mm256_stream_si256((__m256i*)(dst+offset+32),b);
+            _mm256_stream_si256((__m256i*)(dst+offset+64),c);
+            _mm256_stream_si256((__m256i*)(dst+offset+96),d);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void stream_zero_avx2(char* dst, size_t size){
+    __m256i zero=_mm256_setzero_si256();
+    for(; size>0; size-=STREAM_STEP, dst+=STREAM_STEP){
+        for(int offset=0; offset<STREAM_STEP; offset+=32)
+            _mm256_stream_si256((__m256i*)(dst+offset),zero);
+    }
+}
+
+void stream_copy_sse2(char* dst, const char* src, size_t size){    //any x86-64 has SSE2
+    for(; size>0; size-=STREAM_STEP, dst+=STREAM_STEP, src+=STREAM_STEP){
+        for(int offset=0; offset<STREAM_STEP; offset+=64){
+            __m128i a=_mm_loadu_si128((const __m128i*)(src+offset));
+            __m128i b=_mm_loadu_si128((const __m128i*)(src+offset+16));
+            __m128i c=_mm_loadu_si128((const __m128i*)(src+offset+32));
+            __m128i d=_mm_loadu_si128((const __m128i*)(src+offset+48));
+            _mm_stream_si128((__m128i*)(dst+offset),a);
+            _mm_stream_si128((__m128i*)(dst+offset+16),b);
+            _mm_stream_si128((__m128i*)(dst+offset+32),c);
+            _mm_stream_si128((__m128i*)(dst+offset+48),d);
+        }
+    }
+}
+
+void stream_zero_sse2(char* dst, size_t size){
+    __m128i zero=_mm_setzero_si128();
+    for(; size>0; size-=STREAM_STEP, dst+=STREAM_STEP){
+        for(int offset=0; offset<STREAM_STEP; offset+=16)
+            _mm_stream_si128((__m128i*)(dst+offset),zero);
+    }
+}
+
+#define STREAM_SSE2 1
+#define STREAM_AVX2 2
+#define STREAM_AVX512 3
+int stream_level=0;                                 //0: not checked yet
+
+/*
+ *   May run before any constructor (a malloc from the loader or another constructor), so the CPU model is
+ *   initialized here. Threads racing on the first call store the same level.
+ */
+int get_stream_level(){
+    int level=__atomic_load_n(&stream_level,__ATOMIC_RELAXED);
+    if(level!=0)
+        return level;
+
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f"))
+        level=STREAM_AVX512;
+    else if(__builtin_cpu_supports("avx2"))
+        level=STREAM_AVX2;
+    else
+        level=STREAM_SSE2;
+    __atomic_store_n(&stream_level,level,__ATOMIC_RELAXED);
+    return level;
+}
+
+/*
+ *   The head up to a 64 bytes boundary of dst and the tail go through libc, returns the bytes left for the tail.
+ *   The sfence orders the streaming stores before whatever the caller stores next (e.g. publishing the block).
+ */
+size_t stream_body(char* dst, const char* src, size_t size){
+    size_t head=(64-((size_t)dst & 63)) & 63;
+    if(src!=NULL)
+        std::memcpy(dst,src,head);
+    else
+        std::memset(dst,0,head);
+    size_t body=(size-head) & ~(size_t)(STREAM_STEP-1);
+
+    int level=get_stream_level();
+    if(src!=NULL){
+        if(level==STREAM_AVX512)
+            stream_copy_avx512(dst+head,src+head,body);
+        else if(level==STREAM_AVX2)
+            stream_copy_avx2(dst+head,src+head,body);
+        else
+            stream_copy_sse2(dst+head,src+head,body);
+    }else{
+        if(level==STREAM_AVX512)
+            stream_zero_avx512(dst+head,body);
+        else if(level==STREAM_AVX2)
+            stream_zero_avx2(dst+head,body);
+        else
+            stream_zero_sse2(dst+head,body);
+    }
+    _mm_sfence();
+    return size-head-body;
+}
+
+/*
+ *   dst and src must not overlap.
+ */
+void copy_block(void* dst, const void* src, size_t size){
+    if(size<STREAM_THRESHOLD){
+        std::memcpy(dst,src,size);
+        return;
+    }
+    size_t tail=stream_body((char*)dst,(const char*)src,size);
+    std::memcpy((char*)dst+size-tail,(const char*)src+size-tail,tail);
+}
+
+void zero_block(void* dst, size_t size){
+    if(size<STREAM_THRESHOLD){
+        std::memset(dst,0,size);
+        return;
+    }
+    size_t tail=stream_body((char*)dst,NULL,size);
+    std::memset((char*)dst+size-tail,0,tail);
+}
+
+#else
+
+void copy_block(void* dst, const void* src, size_t size){
+    std::memcpy(dst,src,size);
+}
+
+void zero_block(void* dst, size_t size){
+    std::memset(dst,0,size);
+}
+
+#endif
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Mapped Blocks--------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   Requests above MMAP_THRESHOLD get their own anonymous mapping, so freeing them gives the memory
+ *   back to the OS no matter where they are. They are not in the sbrk heap: the header sits at the
+ *   start of the mapping, and the mapped blocks are in a table of their own: open addressing keyed by
+ *   the chunk's address, linear probing, at most half full (deletions shift the run back, no tombstones).
+ *   A pointer is looked up in O(1) without reading memory that may not be mapped any more.
+ */
+struct mmap_chunk{
+    size_t block_size;
+    size_t mapping_size;
+};
+
+#define MMAP_HEADER_SIZE sizeof(mmap_chunk)
+#define MMAP_MAPPING_SIZE(block_size) ((block_size+MMAP_HEADER_SIZE+MMAP_PAGE_SIZE-1) & ~(size_t)(MMAP_PAGE_SIZE-1))
+#define CHUNK_TABLE_MIN (MMAP_PAGE_SIZE/sizeof(mmap_chunk*))     //slots of the first table, a page
+
+mmap_chunk** chunk_table=NULL;                      //a chunk or NULL in every slot, under mmap_lock
+size_t chunk_table_shift=64;                        //the table has 1<<(64-chunk_table_shift) slots
+size_t num_chunks=0;
+
+
+size_t chunk_table_size(){
+    return chunk_table==NULL ? 0 : (size_t)1<<(64-chunk_table_shift);
+}
+
+size_t chunk_home(mmap_chunk* chunk){
+    return (size_t)(((size_t)chunk/MMAP_PAGE_SIZE)*0x9e3779b97f4a7c15ULL)>>chunk_table_shift;
+}
+
+/*
+ *   Called with mmap_lock held. Returns false if there is no room for a bigger table.
+ */
+bool grow_chunk_table(){
+    size_t old_size=chunk_table_size();
+    size_t new_size=old_size==0 ? CHUNK_TABLE_MIN : 2*old_size;
+    void* mapping=mmap(NULL,new_size*sizeof(mmap_chunk*),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    count_syscall();
+    if(mapping==MAP_FAILED)
+        return false;
+
+    mmap_chunk** old_table=chunk_table;
+    chunk_table=(mmap_chunk**)mapping;
+    chunk_table_shift=64-__builtin_ctzl(new_size);
+    for(size_t index=0; index<old_size; index++){
+        if(old_table[index]==NULL)
+            continue;
+        size_t slot=chunk_home(old_table[index]);
+        while(chunk_table[slot]!=NULL)
+            slot=(slot+1)&(new_size-1);
+        chunk_table[slot]=old_table[index];
+    }
+    if(old_table!=NULL){
+        munmap(old_table,old_size*sizeof(mmap_chunk*));
+        count_syscall();
+    }
+    return true;
+}
+
+/*
+ *   Called with mmap_lock held. Returns false if the table is full and can't grow.
+ */
+bool link_chunk(mmap_chunk* chunk){
+    if(2*(num_chunks+1)>chunk_table_size() && !grow_chunk_table() && num_chunks+1>=chunk_table_size())
+        return false;
+
+    size_t slot=chunk_home(chunk);
+    while(chunk_table[slot]!=NULL)
+        slot=(slot+1)&(chunk_table_size()-1);
+    chunk_table[slot]=chunk;
+    num_chunks++;
+    return true;
+}
+
+/*
+ *   The slot of chunk, or -1. Called with mmap_lock held.
+ */
+long find_chunk_slot(mmap_chunk* chunk){
+    if(chunk_table==NULL)
+        return -1;
+    size_t slot=chunk_home(chunk);
+    while(chunk_table[slot]!=NULL){
+        if(chunk_table[slot]==chunk)
+            return (long)slot;
+        slot=(slot+1)&(chunk_table_size()-1);
+    }
+    return -1;
+}
+
+/*
+ *   chunk must be in the table. The chunks after it in its run move back into the hole when their
+ *   home is not between the hole and them, so every chunk stays reachable from its home.
+ */
+void unlink_chunk(mmap_chunk* chunk){
+    size_t mask=chunk_table_size()-1;
+    size_t hole=(size_t)find_chunk_slot(chunk);
+    for(size_t slot=(hole+1)&mask; chunk_table[slot]!=NULL; slot=(slot+1)&mask){
+        size_t home=chunk_home(chunk_table[slot]);
+        if(((slot-home)&mask)>=((slot-hole)&mask)){     //home is at or before the hole
+            chunk_table[hole]=chunk_table[slot];
+            hole=slot;
+        }
+    }
+    chunk_table[hole]=NULL;
+    num_chunks--;
+}
+
+void* mmap_malloc(size_t size){
+    void* mapping=mmap(NULL,MMAP_MAPPING_SIZE(size),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    count_syscall();
+    if(mapping==MAP_FAILED)
+        return NULL;
+
+    mmap_chunk* chunk=(mmap_chunk*)mapping;
+    chunk->block_size=size;
+    chunk->mapping_size=MMAP_MAPPING_SIZE(size);
+
+    lock_acquire(&mmap_lock);
+    bool linked=link_chunk(chunk);
+    if(linked)
+        count_blocks(1,size,MMAP_HEADER_SIZE);
+    lock_release(&mmap_lock);
+    if(!linked){
+        munmap(mapping,MMAP_MAPPING_SIZE(size));
+        count_syscall();
+        return NULL;
+    }
+
+    mark_zeroed((char*)chunk+MMAP_HEADER_SIZE,0);
+    return (char*)chunk+MMAP_HEADER_SIZE;
+}
+
+/*
+ *   The data of a mapped block always starts MMAP_HEADER_SIZE bytes into a page, other pointers
+ *   are rejected at once. The header is read only once the chunk is found in the table,
+ *   so a pointer to a block that was already unmapped is rejected too. Called with mmap_lock held.
+ */
+mmap_chunk* find_mmap_chunk_by_user_ptr(void* user_ptr){
+    if(user_ptr==NULL || ((size_t)user_ptr & (MMAP_PAGE_SIZE-1))!=MMAP_HEADER_SIZE)
+        return NULL;
+
+    mmap_chunk* wanted=(mmap_chunk*)((char*)user_ptr-MMAP_HEADER_SIZE);
+    return find_chunk_slot(wanted)<0 ? NULL : wanted;
+}
+
+/*
+ *   Returns false if p is not a mapped block. The chunk leaves the list under the lock,
+ *   the munmap is done after the lock is released.
+ */
+bool mmap_free(void* p){
+    lock_acquire(&mmap_lock);
+    mmap_chunk* chunk=find_mmap_chunk_by_user_ptr(p);
+    if(chunk!=NULL){
+        unlink_chunk(chunk);
+        count_blocks(-1,-(long)chunk->block_size,-(long)MMAP_HEADER_SIZE);
+    }
+    lock_release(&mmap_lock);
+
+    if(chunk==NULL)
+        return false;
+
+    munmap(chunk,chunk->mapping_size);
+    count_syscall();
+    return true;
+}
+
+/*
+ *   Like realloc, an oldp that is not a mapped block gets a new allocation.
+ *   A mapped block that stays above MMAP_THRESHOLD is never copied: a smaller one unmaps the tail
+ *   of its mapping, a bigger one is moved by mremap, which moves page table entries and not the data.
+ *   While mremap runs the chunk is out of the table, so nobody else can find (or free) it.
+ */
+void* mmap_realloc(void* oldp, size_t size){
+    lock_acquire(&mmap_lock);
+    mmap_chunk* chunk=find_mmap_chunk_by_user_ptr(oldp);
+    if(chunk==NULL){
+        lock_release(&mmap_lock);
+        return malloc(size);
+    }
+    size_t old_mapping_size=chunk->mapping_size;
+    size_t new_mapping_size=MMAP_MAPPING_SIZE(size);
+    if(new_mapping_size==old_mapping_size){             //the mapping already fits
+        count_blocks(0,(long)size-(long)chunk->block_size,0);
+        chunk->block_size=size;
+        lock_release(&mmap_lock);
+        return oldp;
+    }
+
+    if(size>MMAP_THRESHOLD && new_mapping_size<old_mapping_size){
+        count_blocks(0,(long)size-(long)chunk->block_size,0);
+        chunk->block_size=size;
+        chunk->mapping_size=new_mapping_size;
+        lock_release(&mmap_lock);
+
+        munmap((char*)chunk+new_mapping_size,old_mapping_size-new_mapping_size);
+        count_syscall();
+        return oldp;
+    }
+
+    if(size>MMAP_THRESHOLD){
+        unlink_chunk(chunk);
+        lock_release(&mmap_lock);
+
+        void* moved=mremap(chunk,old_mapping_size,new_mapping_size,MREMAP_MAYMOVE);
+        count_syscall();
+
+        lock_acquire(&mmap_lock);
+        if(moved==MAP_FAILED){                          //oldp is left as it was
+            link_chunk(chunk);
+            lock_release(&mmap_lock);
+            return NULL;
+        }
+        chunk=(mmap_chunk*)moved;
+        count_blocks(0,(long)size-(long)chunk->block_size,0);
+        chunk->block_size=size;
+        chunk->mapping_size=new_mapping_size;
+        link_chunk(chunk);
+        lock_release(&mmap_lock);
+        return (char*)chunk+MMAP_HEADER_SIZE;
+    }
+
+    size_t old_size=chunk->block_size;                  //small enough for the heap now
+    lock_release(&mmap_lock);
+
+    void* new_start_of_alloc=malloc(size);
+    if(new_start_of_alloc==NULL)                        //if allocation failed we dont free oldp
+        return NULL;
+
+    copy_block(new_start_of_alloc,oldp,size<old_size ? size : old_size);
+    mmap_free(oldp);
+    return new_start_of_alloc;
+}
+
+
+
+#if SLAB_ALLOCATOR
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Slabs----------------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   Small requests don't get a meta_data. Every slab page holds objects of one size class,
+ *   and the page header (at the start of the page) is found from an object by masking its address.
+ *   Slab pages are carved from one reserved region, so "is this a slab object" is a range check.
+ */
+struct slab_page{
+    size_t magic;
+    size_t object_size;
+    size_t num_objects;             //objects that fit in the page
+    size_t num_carved;              //objects [0,num_carved) were handed out at least once
+    size_t num_used;
+    void* free_objects;             //freed objects, linked through their first word
+    slab_page* next_page;           //partial pages of the same class, or empty pages
+    slab_page* prev_page;
+    unsigned long long used_bitmap[SLAB_BITMAP_WORDS];  //bit i is on while object i is in use
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_page)+SLAB_OBJECT_ALIGN-1)/SLAB_OBJECT_ALIGN*SLAB_OBJECT_ALIGN)
+
+char* slab_region=NULL;
+char* slab_cursor=NULL;                             //pages below the cursor were given to a size class at least once
+bool slab_region_failed=false;
+slab_page* partial_slabs[NUM_SLAB_CLASSES];         //pages with at least one object to give
+slab_page* empty_slabs=NULL;                        //pages without used objects, any class can take them
+
+allocator_lock slab_locks[NUM_SLAB_CLASSES];        //a class's partial pages and the objects of its pages (zero filled
+                                                    //is ALLOCATOR_LOCK_INITIALIZER)
+allocator_lock slab_pool_lock=ALLOCATOR_LOCK_INITIALIZER;  //the region, the empty pages and the page statistics
+
+
+
+void push_slab_page(slab_page** list, slab_page* page){
+    page->prev_page=NULL;
+    page->next_page=*list;
+    if(*list!=NULL)
+        (*list)->prev_page=page;
+    *list=page;
+}
+
+void unlink_slab_page(slab_page** list, slab_page* page){
+    if(page->prev_page!=NULL)
+        page->prev_page->next_page=page->next_page;
+    else
+        *list=page->next_page;
+
+    if(page->next_page!=NULL)
+        page->next_page->prev_page=page->prev_page;
+}
+
+bool reserve_slab_region(){
+    if(slab_region_failed)
+        return false;
+
+    void* region=mmap(NULL,SLAB_REGION_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    count_syscall();
+    if(region==MAP_FAILED){                             //no slabs, small requests go to the heap
+        slab_region_failed=true;
+        return false;
+    }
+
+    slab_region=(char*)region;
+    __atomic_store_n(&slab_cursor,slab_region,__ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ *   Gives a page to size class index, an empty page is reused before a new one is carved.
+ *   Called with the class lock held, takes the pool lock.
+ */
+slab_page* new_slab_page(size_t index){
+    lock_acquire(&slab_pool_lock);
+    slab_page* page=empty_slabs;
+    if(page!=NULL){
+        unlink_slab_page(&empty_slabs,page);
+    }else if((slab_region!=NULL || reserve_slab_region()) && slab_cursor!=slab_region+SLAB_REGION_SIZE){
+        page=(slab_page*)slab_cursor;
+        __atomic_store_n(&slab_cursor,slab_cursor+SLAB_PAGE_SIZE,__ATOMIC_RELEASE);
+    }
+    if(page==NULL){
+        lock_release(&slab_pool_lock);
+        return NULL;
+    }
+
+    page->magic=SLAB_MAGIC;
+    page->object_size=(index+1)*SLAB_OBJECT_ALIGN;
+    page->num_objects=(SLAB_PAGE_SIZE-SLAB_HEADER_SIZE)/page->object_size;
+    page->num_carved=0;
+    page->num_used=0;
+    page->free_objects=NULL;
+    std::memset(page->used_bitmap,0,sizeof(page->used_bitmap));
+
+    lock_release(&slab_pool_lock);
+
+    //every object of a slab page is a block, the page header is its meta data
+    count_blocks(page->num_objects,page->num_objects*page->object_size,SLAB_HEADER_SIZE);
+    count_free_blocks(page->num_objects,page->num_objects*page->object_size);
+
+    push_slab_page(&partial_slabs[index],page);
+    return page;
+}
+
+allocator_lock* slab_lock_of(slab_page* page){
+    return &slab_locks[page->object_size/SLAB_OBJECT_ALIGN-1];
+}
+
+/*
+ *   Returns the page of an object in use, NULL if ptr is not one (foreign, stale or inside an object).
+ *   Called with the lock of the page's class held.
+ */
+slab_page* find_slab_page_by_user_ptr(void* ptr, size_t* object_index){
+    slab_page* page=(slab_page*)((size_t)ptr & ~((size_t)SLAB_PAGE_SIZE-1));
+    size_t offset=(char*)ptr-(char*)page;
+    if(page->magic!=SLAB_MAGIC || offset<SLAB_HEADER_SIZE)
+        return NULL;
+
+    offset-=SLAB_HEADER_SIZE;
+    size_t index=offset/page->object_size;
+    if(offset%page->object_size!=0 || index>=page->num_carved)
+        return NULL;
+    if(!(page->used_bitmap[index/64] & (1ULL<<(index%64))))
+        return NULL;
+
+    *object_index=index;
+    return page;
+}
+
+/*
+ *   If ptr is a slab object in use, returns its page with the lock of the page's class held.
+ *   A page can't change class while it has an object in use, so the class read before taking
+ *   the lock is checked again once it is held.
+ */
+slab_page* lock_slab_page_by_user_ptr(void* ptr, size_t* object_index){
+    char* cursor=__atomic_load_n(&slab_cursor,__ATOMIC_ACQUIRE);
+    if(cursor==NULL || (char*)ptr<slab_region || (char*)ptr>=cursor)
+        return NULL;
+
+    slab_page* page=(slab_page*)((size_t)ptr & ~((size_t)SLAB_PAGE_SIZE-1));
+    size_t object_size=__atomic_load_n(&page->object_size,__ATOMIC_RELAXED);
+    if(object_size==0 || object_size>SLAB_MAX_SIZE || object_size%SLAB_OBJECT_ALIGN!=0)
+        return NULL;
+
+    allocator_lock* lock=&slab_locks[object_size/SLAB_OBJECT_ALIGN-1];
+    lock_acquire(lock);
+    if(page->object_size!=object_size || find_slab_page_by_user_ptr(ptr,object_index)==NULL){
+        lock_release(lock);
+        return NULL;
+    }
+    return page;
+}
+
+/*
+ *   Called with the class lock held.
+ */
+void* take_slab_object(size_t index){
+    slab_page* page=partial_slabs[index];
+    if(page==NULL && (page=new_slab_page(index))==NULL)
+        return NULL;
+
+    void* object;
+    size_t object_index;
+    if(page->free_objects!=NULL){
+        object=page->free_objects;
+        page->free_objects=*(void**)object;
+        object_index=((char*)object-(char*)page-SLAB_HEADER_SIZE)/page->object_size;
+    }else{                                              //objects are carved on demand, a new page isn't touched at once
+        object_index=page->num_carved++;
+        object=(char*)page+SLAB_HEADER_SIZE+object_index*page->object_size;
+    }
+    page->used_bitmap[object_index/64]|=(1ULL<<(object_index%64));
+
+    if(++page->num_used==page->num_objects)            //full pages are not in any list
+        unlink_slab_page(&partial_slabs[index],page);
+
+    count_free_blocks(-1,-(long)page->object_size);
+    return object;
+}
+
+void* slab_malloc(size_t size){
+    size_t index=(size-1)/SLAB_OBJECT_ALIGN;
+    lock_acquire(&slab_locks[index]);
+    void* object=take_slab_object(index);
+    lock_release(&slab_locks[index]);
+    return object;
+}
+
+/*
+ *   Up to num objects of the same class under one lock, returns how many were taken.
+ */
+int slab_malloc_batch(size_t size, void** objects, int num){
+    size_t index=(size-1)/SLAB_OBJECT_ALIGN;
+    int taken=0;
+    lock_acquire(&slab_locks[index]);
+    while(taken<num && (objects[taken]=take_slab_object(index))!=NULL)
+        taken++;
+    lock_release(&slab_locks[index]);
+    return taken;
+}
+
+/*
+ *   Called with the lock of the page's class held, releases it.
+ */
+void slab_free(slab_page* page, void* ptr, size_t object_index){
+    size_t index=page->object_size/SLAB_OBJECT_ALIGN-1;
+    page->used_bitmap[object_index/64]&=~(1ULL<<(object_index%64));
+    *(void**)ptr=page->free_objects;
+    page->free_objects=ptr;
+    count_free_blocks(1,page->object_size);
+
+    if(page->num_used--==page->num_objects)            //was full, has room again
+        push_slab_page(&partial_slabs[index],page);
+
+    //an empty page goes back to the shared pool, unless it is the last page its class has
+    if(page->num_used==0 && (page->prev_page!=NULL || page->next_page!=NULL)){
+        unlink_slab_page(&partial_slabs[index],page);
+
+        lock_acquire(&slab_pool_lock);
+        push_slab_page(&empty_slabs,page);
+        lock_release(&slab_pool_lock);
+
+        long page_bytes=page->num_objects*page->object_size;
+        count_blocks(-(long)page->num_objects,-page_bytes,-(long)SLAB_HEADER_SIZE);
+        count_free_blocks(-(long)page->num_objects,-page_bytes);
+    }
+    lock_release(&slab_locks[index]);
+}
+
+/*
+ *   Called with the lock of the page's class held, releases it.
+ */
+void* slab_realloc(slab_page* page, void* oldp, size_t size){
+    size_t object_size=page->object_size;
+    if(size<=object_size){
+        lock_release(slab_lock_of(page));
+        return oldp;
+    }
+    lock_release(slab_lock_of(page));
+
+    void* new_start_of_alloc=malloc(size);
+    if(new_start_of_alloc==NULL)                        //if allocation failed we dont free oldp
+        return NULL;
+
+    std::memcpy(new_start_of_alloc,oldp,object_size);
+    free(oldp);
+    return new_start_of_alloc;
+}
+#endif
+
+
+
+#if LOCKFREE_LISTS
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Lock-Free Lists------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   Treiber stacks of freed heap blocks, one per LOCKFREE_CLASS_STEP size class, shared by all the threads.
+ *   A block on a stack is still in use as far as its arena knows. It is linked through its first word
+ *   and has LOCKFREE_KEY in its second.
+ *   The head is a single word: the top block's address, and above LOCKFREE_TAG_SHIFT a tag every pop bumps.
+ *   A pop that read a top which was popped and pushed back in the meantime (ABA) fails its CAS on the tag.
+ *   Reading the link of a block another thread already popped is safe, heaps are never unmapped.
+ */
+struct lockfree_stack{
+    unsigned long long head;        //tag<<LOCKFREE_TAG_SHIFT | top
+    size_t count;                   //blocks on the stack, only used to bound it by LOCKFREE_COUNT
+};
+
+#define LOCKFREE_TOP(head) ((void*)((head) & (((unsigned long long)1<<LOCKFREE_TAG_SHIFT)-1)))
+#define LOCKFREE_TAG(head) ((head)>>LOCKFREE_TAG_SHIFT)
+
+lockfree_stack lockfree_stacks[NUM_LOCKFREE_CLASSES];
+
+void flush_lockfree_stack(int index);
+
+void lockfree_push(lockfree_stack* stack, void* block){
+    ((void**)block)[1]=(void*)LOCKFREE_KEY;
+    __atomic_fetch_add(&stack->count,1,__ATOMIC_RELAXED);
+
+    unsigned long long head=__atomic_load_n(&stack->head,__ATOMIC_RELAXED);
+    unsigned long long new_head;
+    do{
+        ((void**)block)[0]=LOCKFREE_TOP(head);
+        new_head=(LOCKFREE_TAG(head)<<LOCKFREE_TAG_SHIFT) | (unsigned long long)block;
+    }while(!__atomic_compare_exchange_n(&stack->head,&head,new_head,true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+}
+
+/*
+ *   Returns NULL if the stack is empty.
+ */
+void* lockfree_pop(lockfree_stack* stack){
+    unsigned long long head=__atomic_load_n(&stack->head,__ATOMIC_ACQUIRE);
+    unsigned long long new_head;
+    do{
+        void* top=LOCKFREE_TOP(head);
+        if(top==NULL)
+            return NULL;
+        void* next=__atomic_load_n(&((void**)top)[0],__ATOMIC_RELAXED);    //may be stale, then the CAS fails
+        new_head=((LOCKFREE_TAG(head)+1)<<LOCKFREE_TAG_SHIFT) | (unsigned long long)next;
+    }while(!__atomic_compare_exchange_n(&stack->head,&head,new_head,true,__ATOMIC_ACQUIRE,__ATOMIC_ACQUIRE));
+
+    void* block=LOCKFREE_TOP(head);
+    ((void**)block)[1]=NULL;
+    __atomic_fetch_sub(&stack->count,1,__ATOMIC_RELAXED);
+    return block;
+}
+
+/*
+ *   Takes the whole stack at once, returns its top (the blocks are linked through their first word).
+ */
+void* lockfree_pop_all(lockfree_stack* stack){
+    unsigned long long head=__atomic_load_n(&stack->head,__ATOMIC_ACQUIRE);
+    unsigned long long new_head;
+    do{
+        if(LOCKFREE_TOP(head)==NULL)
+            return NULL;
+        new_head=(LOCKFREE_TAG(head)+1)<<LOCKFREE_TAG_SHIFT;
+    }while(!__atomic_compare_exchange_n(&stack->head,&head,new_head,true,__ATOMIC_ACQUIRE,__ATOMIC_ACQUIRE));
+    return LOCKFREE_TOP(head);
+}
+
+/*
+ *   A block of at least size bytes, NULL if the stack of size's class is empty.
+ *   Every block of a class is at least as big as any request that maps to it.
+ */
+void* lockfree_malloc(size_t size){
+    return lockfree_pop(&lockfree_stacks[(size-1)/LOCKFREE_CLASS_STEP]);
+}
+
+/*
+ *   Returns false if p is not a heap block the stacks take, or its stack is full.
+ *   A block that has the key may be on its stack already: the stack is given back to the arenas first,
+ *   then the locked path sees the block free and ignores the double free, or frees it if it wasn't there.
+ *   A block that has REMOTE_FREE_KEY may be on a remote_frees stack, the locked path handles it.
+ */
+bool lockfree_free(void* p){
+    meta_data* block=find_block_unlocked(p);
+    if(block==NULL)
+        return false;
+    size_t size=get_block_size(block);
+    if(size<LOCKFREE_CLASS_STEP || size/LOCKFREE_CLASS_STEP>NUM_LOCKFREE_CLASSES)
+        return false;
+
+    int index=(int)(size/LOCKFREE_CLASS_STEP)-1;
+    if(((void**)p)[1]==(void*)LOCKFREE_KEY){
+        flush_lockfree_stack(index);
+        return false;
+    }
+    if(((void**)p)[1]==(void*)REMOTE_FREE_KEY)
+        return false;
+
+    lockfree_stack* stack=&lockfree_stacks[index];
+    if(__atomic_load_n(&stack->count,__ATOMIC_RELAXED)>=LOCKFREE_COUNT)
+        return false;
+
+    lockfree_push(stack,p);
+    return true;
+}
+#endif
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Shared Heap----------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   A block from the heap of the locked arena, NULL if that heap can't grow.
+ */
+meta_data* arena_malloc(size_t size){
+    meta_data* ptr=find_first_fitting_place(size);      //ptr = existing meta data that is currently free
+    if(ptr==NULL)
+        ptr=create_new_meta_data(size);                 //ptr = new meta_data, inserted last to the list
+    return ptr;
+}
+
+/*
+ *   Frees a block of the locked arena, returns false if p is not one of its blocks.
+ */
+bool arena_free(void* p){
+    meta_data* to_release=find_meta_data_by_user_ptr(p);
+    if(to_release==NULL)
+        return false;
+
+    if(!is_block_free(to_release)) {
+        set_free_bit(to_release,true);
+        check_and_combine(to_release);
+    }
+    return true;
+}
+
+/*
+ *   A block freed by a thread of another arena is pushed on its owner's remote_frees stack
+ *   (linked through its first word, REMOTE_FREE_KEY in its second) with one CAS and no lock.
+ *   The owner takes the whole stack with one exchange the next time it holds its lock, so
+ *   there is no ABA: nodes are only ever removed all at once.
+ */
+void push_remote_frees(arena* owner, void* first, void* last){
+    void* head=__atomic_load_n(&owner->remote_frees,__ATOMIC_RELAXED);
+    do{
+        ((void**)last)[0]=head;
+    }while(!__atomic_compare_exchange_n(&owner->remote_frees,&head,first,true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+}
+
+/*
+ *   Frees every block on the remote_frees stack of the locked arena.
+ */
+void drain_remote_frees(arena* owner){
+    if(__atomic_load_n(&owner->remote_frees,__ATOMIC_RELAXED)==NULL)
+        return;
+
+    void* block=__atomic_exchange_n(&owner->remote_frees,NULL,__ATOMIC_ACQUIRE);
+    while(block!=NULL){
+        void* next=((void**)block)[0];
+        ((void**)block)[1]=NULL;
+        arena_free(block);
+        block=next;
+    }
+}
+
+/*
+ *   Pushes p on its owner's remote_frees stack if that is where it should go: the owner is not
+ *   this thread's arena, some thread will drain it, and the block has room for the link and the key.
+ *   A block that has the key may be on the stack already, it is freed under the lock after a drain,
+ *   so a double free is ignored like it is on the locked path.
+ */
+bool remote_free(arena* owner, void* p){
+    if(owner==thread_arena || __atomic_load_n(&owner->num_threads,__ATOMIC_RELAXED)==0)
+        return false;
+
+    meta_data* block=find_block_unlocked(p);
+    if(block==NULL || get_block_size(block)<2*sizeof(void*) || ((void**)p)[1]==(void*)REMOTE_FREE_KEY)
+        return false;
+
+    ((void**)p)[1]=(void*)REMOTE_FREE_KEY;
+    push_remote_frees(owner,p,p);
+    return true;
+}
+
+#if LOCKFREE_LISTS
+/*
+ *   Gives every block waiting on the lock-free stacks back to its arena, so the statistics see it free.
+ */
+void flush_lockfree_stack(int index){
+    void* block=lockfree_pop_all(&lockfree_stacks[index]);
+    while(block!=NULL){
+        void* next=((void**)block)[0];
+        ((void**)block)[1]=NULL;
+        __atomic_fetch_sub(&lockfree_stacks[index].count,1,__ATOMIC_RELAXED);
+
+        arena* owner=find_arena(block);
+        lock_arena(owner);
+        arena_free(block);
+        unlock_arena(owner);
+        block=next;
+    }
+}
+
+void flush_lockfree_stacks(){
+    for(int index=0; index<NUM_LOCKFREE_CLASSES; index++)
+        flush_lockfree_stack(index);
+}
+#endif
+
+/*
+ *   Before the arena of this thread grows, the orphaned arenas are searched for a fitting block,
+ *   so what exited threads left free is used again. Orphans another thread holds are skipped.
+ *   Called with no arena locked.
+ */
+meta_data* orphan_malloc(size_t size, arena* own){
+    int count=__atomic_load_n(&num_arenas,__ATOMIC_ACQUIRE);
+    for(int index=0; index<count; index++){
+        arena* orphan=arenas[index];
+        if(orphan==own || !__atomic_load_n(&orphan->orphaned,__ATOMIC_RELAXED) || !try_lock_arena(orphan))
+            continue;
+
+        drain_remote_frees(orphan);
+        meta_data* ptr=find_first_fitting_place(size);
+        unlock_arena(orphan);
+        if(ptr!=NULL)
+            return ptr;
+    }
+    return NULL;
+}
+
+/*
+ *   Everything behind the thread caches: slabs, mapped blocks and the arenas.
+ *   size is already aligned.
+ */
+void* shared_malloc(size_t size){
+#if SLAB_ALLOCATOR
+    if(size<=SLAB_MAX_SIZE){
+        void* object=slab_malloc(size);
+        if(object!=NULL)                                //no slab page to give, the heap takes the request
+            return object;
+    }
+#endif
+
+    if(size>MMAP_THRESHOLD)
+        return mmap_malloc(size);
+
+#if LOCKFREE_LISTS
+    if(size<=LOCKFREE_MAX_SIZE){
+        void* block=lockfree_malloc(size);
+        if(block!=NULL)                                 //empty stack, the arena takes the request
+            return block;
+    }
+#endif
+
+    arena* own=get_thread_arena();
+    lock_arena(own);
+    drain_remote_frees(own);
+    meta_data* ptr=find_first_fitting_place(size);
+    if(ptr==NULL && __atomic_load_n(&num_orphans,__ATOMIC_RELAXED)!=0){
+        unlock_arena(own);
+        ptr=orphan_malloc(size,own);
+        lock_arena(own);
+    }
+    if(ptr==NULL)
+        ptr=create_new_meta_data(size);                 //own grows
+    unlock_arena(own);
+
+    if(ptr==NULL && own!=&main_arena){                  //the arena's region is used up, sbrk may still have room
+        lock_arena(&main_arena);
+        ptr=arena_malloc(size);
+        unlock_arena(&main_arena);
+    }
+
+    if(ptr==NULL)                                       //ptr = NULL, if sbrk doesnt succeed
+        return NULL;
+
+    return get_start_of_alloc(ptr);
+}
+
+/*
+ *   A block goes back to the arena it came from, whichever thread frees it.
+ *   Blocks of other arenas go through the owner's remote_frees stack, not its lock.
+ *   With LOCKFREE_LISTS, small blocks wait on the lock-free stacks before any of that.
+ */
+void shared_free(void* p){
+#if SLAB_ALLOCATOR
+    size_t object_index;
+    slab_page* page=lock_slab_page_by_user_ptr(p,&object_index);
+    if(page!=NULL){
+        slab_free(page,p,object_index);
+        return;
+    }
+#endif
+    arena* owner=find_arena(p);
+    if(owner==NULL){
+        mmap_free(p);
+        return;
+    }
+#if LOCKFREE_LISTS
+    if(lockfree_free(p))
+        return;
+#endif
+    if(remote_free(owner,p))
+        return;
+
+    lock_arena(owner);
+    drain_remote_frees(owner);
+    arena_free(p);
+    unlock_arena(owner);
+}
+
+/*
+ *   Up to num blocks of the same (small) size, the arena lock is taken once for all of them.
+ *   Returns how many were allocated.
+ */
+int shared_malloc_batch(size_t size, void** blocks, int num){
+    int taken=0;
+#if SLAB_ALLOCATOR
+    if(size<=SLAB_MAX_SIZE)
+        taken=slab_malloc_batch(size,blocks,num);
+#endif
+
+    if(taken<num){
+        arena* own=get_thread_arena();
+        lock_arena(own);
+        drain_remote_frees(own);
+        meta_data* ptr;
+        while(taken<num && (ptr=arena_malloc(size))!=NULL)
+            blocks[taken++]=get_start_of_alloc(ptr);
+        unlock_arena(own);
+    }
+    if(taken==0)
+        blocks[taken++]=shared_malloc(size);
+    return blocks[0]==NULL ? 0 : taken;
+}
+
+/*
+ *   Frees num blocks, every arena lock is taken once for all the blocks of that arena.
+ *   The blocks of another thread's arena are chained and pushed on its remote_frees stack at once.
+ */
+void shared_free_batch(void** blocks, int num){
+    while(num>0){
+        arena* owner=find_arena(blocks[0]);
+        if(owner==NULL){                                //not a heap block
+            shared_free(blocks[0]);
+            blocks[0]=blocks[--num];
+            continue;
+        }
+
+        int left=0;
+        if(owner!=thread_arena && __atomic_load_n(&owner->num_threads,__ATOMIC_RELAXED)>0){
+            void* first=NULL;
+            void* last=NULL;
+            for(int i=0; i<num; i++){
+                meta_data* block;
+                if(find_arena(blocks[i])!=owner){
+                    blocks[left++]=blocks[i];           //another arena's, next round
+                }else if((block=find_block_unlocked(blocks[i]))==NULL || get_block_size(block)<2*sizeof(void*) ||
+                         ((void**)blocks[i])[1]==(void*)REMOTE_FREE_KEY){
+                    shared_free(blocks[i]);             //remote_free would refuse it too
+                }else{
+                    ((void**)blocks[i])[0]=first;
+                    ((void**)blocks[i])[1]=(void*)REMOTE_FREE_KEY;
+                    if(first==NULL)
+                        last=blocks[i];
+                    first=blocks[i];
+                }
+            }
+            if(first!=NULL)
+                push_remote_frees(owner,first,last);
+            num=left;
+            continue;
+        }
+
+        lock_arena(owner);
+        drain_remote_frees(owner);
+        for(int i=0; i<num; i++){
+            if(find_arena(blocks[i])==owner)
+                arena_free(blocks[i]);
+            else
+                blocks[left++]=blocks[i];               //another arena's, next round
+        }
+        unlock_arena(owner);
+        num=left;
+    }
+}
+
+
+
+#if REALLOC_SLACK
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Realloc Slack--------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   Appending with realloc in small steps would move the block (or grow the wilderness) on every step.
+ *   An arena watches the last GROWTH_SLOTS of its heap blocks that were reallocated. Once one grows
+ *   GROWTH_STREAK times in a row, its next move or growth asks for twice the size, so the growths after it
+ *   fit in place. The slot keeps the size the user asked for, which is how much of a block with slack
+ *   is in use, and freeing the block empties its slot, so the slack is never taken for user data.
+ *   The slack goes back when the block is freed, when a realloc stops growing it, and when it drops out
+ *   of its arena's slots. The slots are read and written with their arena locked.
+ */
+
+/*
+ *   block is free now, it leaves its slot.
+ */
+void forget_growth(meta_data* block){
+    for(int index=0; index<GROWTH_SLOTS; index++)
+        if(current_arena->growth_slots[index].block==block)
+            current_arena->growth_slots[index].block=NULL;
+}
+
+/*
+ *   The slot of block, a new one if it isn't watched yet: the block that had it gives its slack back.
+ */
+growth_slot* watch_growth(meta_data* block){
+    growth_slot* slots=current_arena->growth_slots;
+    for(int index=0; index<GROWTH_SLOTS; index++)
+        if(slots[index].block==block)
+            return &slots[index];
+
+    growth_slot* slot=&slots[current_arena->growth_victim];
+    current_arena->growth_victim=(current_arena->growth_victim+1)%GROWTH_SLOTS;
+    if(slot->block!=NULL && slot->slack)
+        check_and_split(slot->block,slot->requested);
+    slot->block=block;
+    slot->requested=0;
+    slot->grows=0;
+    slot->slack=false;
+    return slot;
+}
+
+/*
+ *   Called when realloc asks for size bytes of the slot's block.
+ *   Returns the size to grow the block to: size, or twice size for a block that keeps growing.
+ *   realloc sets slack again if it leaves the block bigger than size.
+ */
+size_t plan_growth(growth_slot* slot, size_t size){
+    slot->slack=false;
+    if(size<=slot->requested || size<GROWTH_MIN_SIZE){  //not a growth, the block gives its slack back
+        slot->grows=0;
+        slot->requested=size;
+        return size;
+    }
+
+    slot->requested=size;
+    slot->grows++;
+    if(slot->grows<GROWTH_STREAK || 2*size>MMAP_THRESHOLD)
+        return size;
+    return 2*size;
+}
+#endif
+
 
 
+#if TCACHE_COUNT
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Thread Caches--------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
 
-void check_and_combine(meta_data* to_release){
-    if(to_release->prev_ptr!=NULL && to_release->prev_ptr->is_free){        //combine to_release and prev
-        to_release->prev_ptr->next_ptr=to_release->next_ptr;
+/*
+ *   Every thread keeps up to TCACHE_COUNT freed blocks per size bin (bins are TCACHE_BIN_STEP bytes apart),
+ *   so a malloc that follows a free of the same size on the same thread takes no lock.
+ *   Cached blocks are still in use as far as the shared heap (and the statistics) know.
+ *   A cached block is linked through its first word, and its second word holds TCACHE_KEY,
+ *   which is how a second free of a cached block is caught.
+ *   Misses refill a bin with TCACHE_BATCH blocks at once, a full bin flushes TCACHE_BATCH blocks at once.
+ */
+struct thread_cache{
+    void* bins[TCACHE_BINS];
+    unsigned int counts[TCACHE_BINS];
+    size_t hits;                    //not published yet, they are added to tcache_hits on the next miss or flush
+};
+
+__thread thread_cache tcache;
+size_t tcache_hits=0;                               //of all threads
+size_t tcache_misses=0;
 
-        if(to_release->next_ptr!=NULL)            //checks that to_release is not the last node in list
-            to_release->next_ptr->prev_ptr=to_release->prev_ptr;
-        else
-            last_data=to_release->prev_ptr;
 
-        to_release->prev_ptr->block_size+=(ALIGNED_META_DATA+to_release->block_size);
-        to_release=to_release->prev_ptr;
+void publish_tcache_hits(){
+    if(tcache.hits!=0){
+        __atomic_fetch_add(&tcache_hits,tcache.hits,__ATOMIC_RELAXED);
+        tcache.hits=0;
     }
+}
 
-    if(to_release->next_ptr!=NULL && to_release->next_ptr->is_free){        //combine to_release and next
-        if(to_release->next_ptr->next_ptr!=NULL)
-            to_release->next_ptr->next_ptr->prev_ptr=to_release;
-        else
-            last_data=to_release;
+void tcache_push(size_t bin, void* block){
+    ((void**)block)[0]=tcache.bins[bin];
+    ((void**)block)[1]=(void*)TCACHE_KEY;
+    tcache.bins[bin]=block;
+    tcache.counts[bin]++;
+}
 
-        to_release->block_size+=(ALIGNED_META_DATA+to_release->next_ptr->block_size);
+void* tcache_pop(size_t bin){
+    void* block=tcache.bins[bin];
+    tcache.bins[bin]=((void**)block)[0];
+    ((void**)block)[1]=NULL;
+    tcache.counts[bin]--;
+    return block;
+}
 
-        to_release->next_ptr=to_release->next_ptr->next_ptr;
+/*
+ *   Size of a block this thread may cache, 0 for anything else (mapped blocks, foreign pointers).
+ */
+size_t tcache_block_size(void* p){
+#if SLAB_ALLOCATOR
+    char* cursor=__atomic_load_n(&slab_cursor,__ATOMIC_ACQUIRE);
+    if(cursor!=NULL && (char*)p>=slab_region && (char*)p<cursor){
+        //a page keeps its class while it has an object in use, so the class is read without its lock
+        slab_page* page=(slab_page*)((size_t)p & ~((size_t)SLAB_PAGE_SIZE-1));
+        size_t object_size=__atomic_load_n(&page->object_size,__ATOMIC_RELAXED);
+        size_t object_index;
+        if(object_size==0 || object_size>SLAB_MAX_SIZE || find_slab_page_by_user_ptr(p,&object_index)==NULL)
+            return 0;
+        return object_size;
     }
+#endif
+    meta_data* block=find_block_unlocked(p);
+    return block==NULL ? 0 : get_block_size(block);
 }
 
-void check_and_split(meta_data* current, size_t size){
-    if(current->block_size<(size+ALIGNED_META_DATA+LARGE_ENOUGH))
-        return;
+#if PERCPU_RSEQ
+/*
+ *   With PERCPU_CACHE the bins belong to CPUs instead of threads, so the blocks the caches hold are
+ *   bounded by the number of CPUs, however many threads there are.
+ *   A CPU's bin is an array of TCACHE_COUNT slots and a count. A push or pop is a restartable sequence:
+ *   it reads the CPU number from the rseq area glibc registered for the thread, and its last instruction
+ *   stores the new count. If the thread is preempted, migrated or signaled before that store,
+ *   the kernel sends it to the abort handler and the sequence starts over, so no atomics are needed.
+ *   Cached blocks still hold TCACHE_KEY in their second word.
+ *   A thread without an rseq area (old kernel, or disabled in glibc) keeps a thread cache instead.
+ */
+struct cpu_cache{
+    size_t counts[TCACHE_BINS];
+    void* slots[TCACHE_BINS][TCACHE_COUNT];
+};
 
-    meta_data* new_meta_data=(meta_data*)current->start_of_alloc;             //inserts new meta_data to list
-    (char*)new_meta_data += size;
-    new_meta_data->is_free=true;
+cpu_cache* cpu_caches=NULL;                         //one per configured CPU, mapped on first use
+unsigned int num_cpu_caches=0;
+bool cpu_caches_failed=false;
+allocator_lock cpu_caches_lock=ALLOCATOR_LOCK_INITIALIZER;
 
-    new_meta_data->block_size=current->block_size-(size+ALIGNED_META_DATA);
+__thread int cpu_cache_state=0;                     //0: not checked yet, 1: per CPU, -1: per thread
 
-    current->block_size=size;
-    new_meta_data->start_of_alloc=(char*)new_meta_data+ALIGNED_META_DATA;
 
-    new_meta_data->next_ptr=current->next_ptr;          //updates pointers of list
-    if(current->next_ptr!=NULL)
-        current->next_ptr->prev_ptr=new_meta_data;
-    current->next_ptr=new_meta_data;
-    new_meta_data->prev_ptr=current;
+struct rseq* thread_rseq(){
+    return (struct rseq*)((char*)__builtin_thread_pointer()+__rseq_offset);
+}
 
-    check_and_combine(new_meta_data);
+bool map_cpu_caches(){
+    lock_acquire(&cpu_caches_lock);
+    if(cpu_caches==NULL && !cpu_caches_failed){
+        long num_cpus=sysconf(_SC_NPROCESSORS_CONF);
+        if(num_cpus<1)
+            num_cpus=1;
+        void* mapping=mmap(NULL,num_cpus*sizeof(cpu_cache),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        count_syscall();
+        if(mapping==MAP_FAILED){
+            cpu_caches_failed=true;
+        }else{
+            num_cpu_caches=(unsigned int)num_cpus;
+            __atomic_store_n(&cpu_caches,(cpu_cache*)mapping,__ATOMIC_RELEASE);
+        }
+    }
+    lock_release(&cpu_caches_lock);
+    return !cpu_caches_failed;
 }
 
-meta_data* come_to_help_a_friend(meta_data* current, meta_data* next, int size){
+bool use_cpu_caches(){
+    if(cpu_cache_state==0){
+        bool has_rseq=__rseq_size!=0 && (int)thread_rseq()->cpu_id>=0;
+        cpu_cache_state=has_rseq && map_cpu_caches() ? 1 : -1;
+    }
+    return cpu_cache_state==1;
+}
 
-    if(current->block_size+next->block_size+ALIGNED_META_DATA < size)
-        return NULL;                        //not enough space in current+next for requested realloc
+/*
+ *   Returns false if the bin of this CPU is full (or the CPU has no cache), the block is not cached then.
+ */
+bool cpu_cache_push(size_t bin, void* block){
+    ((void**)block)[1]=(void*)TCACHE_KEY;           //before the commit, another thread of the CPU may pop it right after
+    cpu_cache* caches=__atomic_load_n(&cpu_caches,__ATOMIC_ACQUIRE);
+retry:
+    __asm__ __volatile__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"                           //version, flags
+        ".quad 1f, (2f-1f), 4f\n\t"                //start, length, abort handler
+        ".popsection\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long %c[sig]\n\t"                        //the signature must sit right before the abort handler
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, 8(%[rseq])\n\t"               //rseq->rseq_cs
+        "1:\n\t"
+        "movl 4(%[rseq]), %%eax\n\t"               //rseq->cpu_id
+        "cmpl %k[num_cpus], %%eax\n\t"
+        "jae %l[full]\n\t"
+        "imulq %[stride], %%rax, %%rax\n\t"
+        "addq %[caches], %%rax\n\t"
+        "movq (%%rax,%[bin],8), %%rcx\n\t"
+        "cmpq %[count], %%rcx\n\t"
+        "jae %l[full]\n\t"
+        "leaq (%[first_slot],%%rcx), %%rdx\n\t"
+        "movq %[block], %c[slots](%%rax,%%rdx,8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%%rax,%[bin],8)\n\t"         //commit
+        "2:\n\t"
+        :
+        : [rseq]"r"(thread_rseq()), [num_cpus]"r"(num_cpu_caches), [caches]"r"(caches), [bin]"r"(bin),
+          [first_slot]"r"(bin*TCACHE_COUNT), [block]"r"(block), [stride]"i"(sizeof(cpu_cache)),
+          [slots]"i"(offsetof(cpu_cache,slots)), [count]"i"(TCACHE_COUNT), [sig]"i"(RSEQ_SIG)
+        : "rax","rcx","rdx","memory","cc"
+        : abort, full);
+    return true;
+abort:
+    goto retry;
+full:
+    ((void**)block)[1]=NULL;
+    return false;
+}
 
-    if(((int)size-((int)(current->block_size) + (int)(next->block_size))) < LARGE_ENOUGH &&
-            ((int)size-((int)(current->block_size) + (int)(next->block_size))) > 0){     //merge current and next
-        current->next_ptr=next->next_ptr;                   //deleting the next meta_data node
-        if(next->next_ptr!=NULL)
-            next->next_ptr->prev_ptr=current;
-        else{
-            last_data=current;
+/*
+ *   Whether block is in bin of some CPU. The bins change under the search, which reads them without a lock
+ *   (they are never unmapped), so it may miss a block another thread is moving at that moment.
+ */
+bool in_cpu_caches(size_t bin, void* block){
+    cpu_cache* caches=__atomic_load_n(&cpu_caches,__ATOMIC_ACQUIRE);
+    for(unsigned int cpu=0; cpu<num_cpu_caches; cpu++){
+        size_t count=__atomic_load_n(&caches[cpu].counts[bin],__ATOMIC_RELAXED);
+        for(size_t slot=0; slot<count && slot<TCACHE_COUNT; slot++){
+            if(__atomic_load_n(&caches[cpu].slots[bin][slot],__ATOMIC_RELAXED)==block)
+                return true;
         }
-        current->block_size+=next->block_size+ALIGNED_META_DATA;
-        return current;
     }
+    return false;
+}
 
-    //next now needs to give current the requested bytes, and become smaller
+/*
+ *   Returns NULL if the bin of this CPU is empty (or the CPU has no cache).
+ */
+void* cpu_cache_pop(size_t bin){
+    cpu_cache* caches=__atomic_load_n(&cpu_caches,__ATOMIC_ACQUIRE);
+    void* block;
+retry:
+    __asm__ __volatile__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, (2f-1f), 4f\n\t"
+        ".popsection\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, 8(%[rseq])\n\t"
+        "1:\n\t"
+        "movl 4(%[rseq]), %%eax\n\t"
+        "cmpl %k[num_cpus], %%eax\n\t"
+        "jae %l[empty]\n\t"
+        "imulq %[stride], %%rax, %%rax\n\t"
+        "addq %[caches], %%rax\n\t"
+        "movq (%%rax,%[bin],8), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[empty]\n\t"
+        "decq %%rcx\n\t"
+        "leaq (%[first_slot],%%rcx), %%rdx\n\t"
+        "movq %c[slots](%%rax,%%rdx,8), %%rdx\n\t"
+        "movq %%rdx, (%[block])\n\t"
+        "movq %%rcx, (%%rax,%[bin],8)\n\t"         //commit
+        "2:\n\t"
+        :
+        : [rseq]"r"(thread_rseq()), [num_cpus]"r"(num_cpu_caches), [caches]"r"(caches), [bin]"r"(bin),
+          [first_slot]"r"(bin*TCACHE_COUNT), [block]"r"(&block), [stride]"i"(sizeof(cpu_cache)),
+          [slots]"i"(offsetof(cpu_cache,slots)), [sig]"i"(RSEQ_SIG)
+        : "rax","rcx","rdx","memory","cc"
+        : abort, empty);
+    ((void**)block)[1]=NULL;
+    return block;
+abort:
+    goto retry;
+empty:
+    return NULL;
+}
 
+void* cpu_cache_malloc(size_t size){
+    size_t bin=(size-1)/TCACHE_BIN_STEP;
+    void* block=cpu_cache_pop(bin);
+    if(block!=NULL){
+        tcache.hits++;
+        return block;
+    }
 
-    int tmp_block_size=next->block_size;
-    meta_data* tmp_next_ptr=next->next_ptr;
-    meta_data* tmp_prev_ptr=next->prev_ptr;
+    __atomic_fetch_add(&tcache_misses,1,__ATOMIC_RELAXED);
+    publish_tcache_hits();
 
-    (char*)next+=(size-current->block_size);
-    next->start_of_alloc=(char*)next+ALIGNED_META_DATA;
-    next->block_size=tmp_block_size-(size-current->block_size);
+    size_t bin_size=(bin+1)*TCACHE_BIN_STEP;
+    if(bin_size<MIN_BLOCK_SIZE)
+        bin_size=MIN_BLOCK_SIZE;
 
-    current->next_ptr=next;
-    next->next_ptr=tmp_next_ptr;
-    next->prev_ptr=tmp_prev_ptr;
-    if(next->next_ptr)
-        next->next_ptr->prev_ptr=next;
+    void* blocks[TCACHE_BATCH];
+    int taken=shared_malloc_batch(bin_size,blocks,TCACHE_BATCH);
+    if(taken==0)
+        return NULL;
+    int left=1;
+    for(int i=1; i<taken; i++){
+        if(!cpu_cache_push(bin,blocks[i]))          //the thread moved to a CPU whose bin is full
+            blocks[left++]=blocks[i];
+    }
+    if(left>1)
+        shared_free_batch(blocks+1,left-1);
+    return blocks[0];
+}
 
-    current->block_size=size;
-    
-    return current;
+#if MAINTENANCE_THREAD
+/*
+ *   Gives back every block in the bins of cpu. The calling thread moves itself to cpu first,
+ *   its pops are restartable sequences like those of any other thread running there.
+ *   Returns false if it couldn't run there (the CPU is offline or not in its cpuset).
+ */
+bool drain_cpu_cache(unsigned int cpu, cpu_set_t* home){
+    cpu_set_t target;
+    CPU_ZERO(&target);
+    CPU_SET(cpu,&target);
+    if(sched_setaffinity(0,sizeof(target),&target)!=0)
+        return false;
+
+    bool on_cpu=thread_rseq()->cpu_id==cpu;
+    for(size_t bin=0; on_cpu && bin<TCACHE_BINS; bin++){
+        void* blocks[TCACHE_COUNT];
+        int num=0;
+        while(num<TCACHE_COUNT && (blocks[num]=cpu_cache_pop(bin))!=NULL)
+            num++;
+        if(num>0)
+            shared_free_batch(blocks,num);
+    }
+    sched_setaffinity(0,sizeof(*home),home);
+    return on_cpu;
+}
+
+/*
+ *   Changes whenever a bin of cpu gains or loses blocks (as good as always), 0 if its bins are empty.
+ */
+size_t cpu_cache_mark(unsigned int cpu){
+    size_t mark=0;
+    for(size_t bin=0; bin<TCACHE_BINS; bin++)
+        mark+=__atomic_load_n(&cpu_caches[cpu].counts[bin],__ATOMIC_RELAXED)*(bin+1);
+    return mark;
 }
+#endif
+#endif
+
+void* tcache_malloc(size_t size){
+    if(thread_exited)
+        return shared_malloc(size);
+#if PERCPU_RSEQ
+    if(use_cpu_caches())
+        return cpu_cache_malloc(size);
+#endif
+    size_t bin=(size-1)/TCACHE_BIN_STEP;
+    if(tcache.bins[bin]!=NULL){
+        tcache.hits++;
+        return tcache_pop(bin);
+    }
 
+    __atomic_fetch_add(&tcache_misses,1,__ATOMIC_RELAXED);
+    publish_tcache_hits();
 
-bool wilderness_expand(size_t size_differnce){
-    void* alloc_check=sbrk(size_differnce);
+    size_t bin_size=(bin+1)*TCACHE_BIN_STEP;
+    if(bin_size<MIN_BLOCK_SIZE)
+        bin_size=MIN_BLOCK_SIZE;
 
-    if(alloc_check==(void*)(-1)){       //if allocation failed
+    void* blocks[TCACHE_BATCH];
+    int taken=shared_malloc_batch(bin_size,blocks,TCACHE_BATCH);
+    if(taken==0)
+        return NULL;
+    for(int i=1; i<taken; i++)
+        tcache_push(bin,blocks[i]);
+    return blocks[0];
+}
+
+/*
+ *   Returns false if p is not a block the thread caches take, then the shared heap frees it.
+ */
+bool tcache_free(void* p){
+    if(thread_exited)
+        return false;
+    size_t size=tcache_block_size(p);
+    if(size<TCACHE_BIN_STEP || size/TCACHE_BIN_STEP>TCACHE_BINS)
         return false;
+    size_t bin=size/TCACHE_BIN_STEP-1;                  //every request that maps to bin fits in the block
+
+#if PERCPU_RSEQ
+    if(use_cpu_caches()){
+        if(((void**)p)[1]==(void*)TCACHE_KEY)           //maybe in a CPU's bin already: a double free is ignored,
+            return in_cpu_caches(bin,p);                //anything else goes to the locked path, which checks it
+        if(cpu_cache_push(bin,p))
+            return true;
+
+        void* blocks[TCACHE_BATCH];                     //the bin is full, it gives back a batch with p
+        int num=0;
+        blocks[num++]=p;
+        while(num<TCACHE_BATCH && (blocks[num]=cpu_cache_pop(bin))!=NULL)
+            num++;
+        publish_tcache_hits();
+        shared_free_batch(blocks,num);
+        return true;
+    }
+#endif
+
+    if(!exit_watched)                                   //a thread that only frees has a cache to flush too
+        watch_thread_exit();
+
+    if(((void**)p)[1]==(void*)TCACHE_KEY){              //maybe cached already, a double free is ignored
+        for(void* cached=tcache.bins[bin]; cached; cached=((void**)cached)[0]){
+            if(cached==p)
+                return true;
+        }
     }
 
+    tcache_push(bin,p);
+    if(tcache.counts[bin]>TCACHE_COUNT){
+        void* blocks[TCACHE_BATCH];
+        for(int i=0; i<TCACHE_BATCH; i++)
+            blocks[i]=tcache_pop(bin);
+        publish_tcache_hits();
+        shared_free_batch(blocks,TCACHE_BATCH);
+    }
     return true;
 }
+#endif
+
 
 
 
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Thread Exit----------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
 /*
- *   Returns NULL if there is no empty place in the list
+ *   A thread that gets a stats slot or caches a block sets a pthread key, whose destructor runs when
+ *   the thread exits: the thread cache goes back to the shared heap in batches of THREAD_EXIT_BATCH,
+ *   the thread leaves its arena (an orphaned arena gets its remote_frees drained), and its stats
+ *   slot is kept for the next new thread.
+ *   If a destructor of someone else makes the thread take a lock again, it gets a slot again and sets the
+ *   key again, and pthread runs the destructor once more (up to PTHREAD_DESTRUCTOR_ITERATIONS times).
  */
-meta_data* find_first_fitting_place(size_t size){
-    meta_data* current=first_data;
-    while(current){
-        if(!current->is_free) {                         //if the current block is occupied - continue
-            current=current->next_ptr;
-            continue;
+#define THREAD_EXIT_BATCH 256
+
+pthread_key_t thread_exit_key;
+pthread_once_t thread_exit_once=PTHREAD_ONCE_INIT;
+
+
+#if TCACHE_COUNT
+void flush_thread_cache(){
+    void* blocks[THREAD_EXIT_BATCH];
+    int num=0;
+    for(size_t bin=0; bin<TCACHE_BINS; bin++){
+        while(tcache.bins[bin]!=NULL){
+            blocks[num++]=tcache_pop(bin);
+            if(num==THREAD_EXIT_BATCH){
+                shared_free_batch(blocks,num);
+                num=0;
+            }
         }
-        if(current->block_size>=size) {
-            current->is_free=false;
-            check_and_split(current,size);
-            return current;
-        }else if(current==last_data){                   //block_size < size && the last_data is free (problem 3)
-            if(!(wilderness_expand(size-current->block_size)))
-                return NULL;
-
-            current->block_size=size;
-            return current;
+    }
+    if(num>0)
+        shared_free_batch(blocks,num);
+    publish_tcache_hits();
+}
+#endif
+
+void thread_exit(void*){
+    if(!thread_exited){
+        thread_exited=true;
+#if TCACHE_COUNT
+        flush_thread_cache();
+#endif
+        arena* left=thread_arena;
+        if(leave_arena()){                              //nobody would drain it until a thread gets it
+            lock_arena(left);
+            drain_remote_frees(left);
+            unlock_arena(left);
         }
-        current=current->next_ptr;                      //else - block is free but not big enough
     }
+    release_thread_stats();
+}
 
-    return NULL;
+void create_thread_exit_key(){
+    pthread_key_create(&thread_exit_key,thread_exit);
 }
-meta_data* find_meta_data_by_user_ptr(void* user_ptr){
-    if(user_ptr==NULL)
-        return NULL;
 
-    meta_data* current=first_data;
-    while(current){
-        if(current->start_of_alloc==user_ptr)
-            return current;
+void watch_thread_exit(){
+    if(exit_watched && !thread_exited)
+        return;
+    pthread_once(&thread_exit_once,create_thread_exit_key);
+    pthread_setspecific(thread_exit_key,(void*)1);
+    exit_watched=true;
+}
 
-        current=current->next_ptr;
-    }
-    return NULL;
+
+
+#if MAINTENANCE_THREAD
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Maintenance----------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   A background thread, started by the first thread that gets an arena, wakes every interval_ms and
+ *   does the housekeeping no malloc or free should wait for:
+ *   frees what other threads left on the remote_frees stacks, gives the pages of big free wilderness
+ *   blocks back to the OS, moves blocks from the lock-free stacks back to their arenas (so they can
+ *   combine), and empties the caches of CPUs that didn't use them since its last wake.
+ *   Every wake stops once it used budget_us of CPU time, the next one goes on from where it stopped.
+ *   Wilderness pages are given back with MADV_DONTNEED, not by moving the program break:
+ *   find_arena and find_block_unlocked read headers without a lock, and rely on heaps never shrinking.
+ */
+int maintenance_started=0;
+long maintenance_interval_ms=MAINTENANCE_INTERVAL_MS;
+long maintenance_budget_us=MAINTENANCE_BUDGET_US;
+size_t maintenance_cursor=0;                        //the next step, see maintenance_step
+size_t num_trims=0;
+#if PERCPU_RSEQ
+size_t* cpu_marks=NULL;                             //cpu_cache_mark of every CPU at the last visit
+cpu_set_t maintenance_home;                         //where the thread may run, it returns there after a drain
+#endif
+
+
+long env_or(const char* name, long value){
+    char* env=getenv(name);
+    if(env==NULL || atol(env)<=0)
+        return value;
+    return atol(env);
 }
 
-meta_data* create_new_meta_data(size_t size){
-   if(first_data==NULL){
-       void* program_break=sbrk(0);
-       if(SIZE_NOT_ALIGNED((int)program_break))
-           sbrk(ALIGN_SIZE((int)program_break));
-   }
+/*
+ *   Called with the arena locked. Everything past the free links of the wilderness block (and before its
+ *   footer) is given back, the block stays in the heap and its free list.
+ *   The bytes of the last, partial page are cleared, so a calloc of the block can trust all of it (dirty_bytes).
+ */
+void trim_wilderness(){
+    if(last_data==NULL || !is_block_free(last_data) || get_block_size(last_data)<TRIM_THRESHOLD)
+        return;
+    if(trimmed_zero(last_data)!=NULL)
+        return;                                         //nothing was touched since the last trim
+
+    size_t start=(size_t)get_start_of_alloc(last_data)+2*sizeof(void*);
+    size_t end=(size_t)get_start_of_alloc(last_data)+get_block_size(last_data)-sizeof(size_t);
+    start=(start+MMAP_PAGE_SIZE-1) & ~(size_t)(MMAP_PAGE_SIZE-1);
+    end&=~(size_t)(MMAP_PAGE_SIZE-1);
+    if(start>=end)
+        return;
+    madvise((void*)start,end-start,MADV_DONTNEED);
+    count_syscall();
+    __atomic_fetch_add(&num_trims,1,__ATOMIC_RELAXED);
+    std::memset((void*)end,0,(size_t)get_start_of_alloc(last_data)+get_block_size(last_data)-sizeof(size_t)-end);
 
+    set_trimmed(last_data,(char*)start);
+}
 
-    meta_data* data_to_add=(meta_data*)sbrk(ALIGNED_META_DATA);
-    if(data_to_add==(void*)(-1))
-        return NULL;
+void maintain_arena(arena* maintained){
+    lock_arena(maintained);
+    drain_remote_frees(maintained);
+    trim_wilderness();
+    unlock_arena(maintained);
+}
 
-    data_to_add->is_free=true;                         //initializing the mete_data fields
-//    data_to_add->current_size=size;
-    data_to_add->block_size=size;
-    data_to_add->start_of_alloc=sbrk(size);
+#if PERCPU_RSEQ
+void maintain_cpu_cache(unsigned int cpu){
+    if(cpu_marks==NULL){
+        void* mapping=mmap(NULL,num_cpu_caches*sizeof(size_t),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        count_syscall();
+        if(mapping==MAP_FAILED)
+            return;
+        cpu_marks=(size_t*)mapping;
+    }
 
-    if(data_to_add->start_of_alloc==(void*)(-1)){       //if allocation failed we dont add data_to_add to the list
-        return NULL;
+    size_t mark=cpu_cache_mark(cpu);
+    if(mark!=0 && mark==cpu_marks[cpu] && drain_cpu_cache(cpu,&maintenance_home))
+        mark=cpu_cache_mark(cpu);
+    cpu_marks[cpu]=mark;
+}
+#endif
+
+/*
+ *   The steps of a full round: every arena, every lock-free stack, every CPU cache.
+ *   Returns false once the round is done.
+ */
+bool maintenance_step(size_t step){
+    size_t count=__atomic_load_n(&num_arenas,__ATOMIC_ACQUIRE);
+    if(step<count){
+        maintain_arena(arenas[step]);
+        return true;
+    }
+    step-=count;
+#if LOCKFREE_LISTS
+    if(step<NUM_LOCKFREE_CLASSES){
+        flush_lockfree_stack((int)step);
+        return true;
     }
+    step-=NUM_LOCKFREE_CLASSES;
+#endif
+#if PERCPU_RSEQ
+    if(__atomic_load_n(&cpu_caches,__ATOMIC_ACQUIRE)!=NULL && use_cpu_caches() && step<num_cpu_caches){
+        maintain_cpu_cache((unsigned int)step);
+        return true;
+    }
+#endif
+    return false;
+}
 
-    if(!first_data){
-        first_data=data_to_add;
-        last_data=data_to_add;
-        data_to_add->next_ptr=NULL;
-        data_to_add->prev_ptr=NULL;
-    }else {
-        last_data->next_ptr = data_to_add;
-        data_to_add->prev_ptr = last_data;
-        data_to_add->next_ptr = NULL;
-        last_data = data_to_add;
+long thread_cpu_us(){
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+    return ts.tv_sec*1000000L+ts.tv_nsec/1000;
+}
+
+void* maintenance_thread(void*){
+#if PERCPU_RSEQ
+    sched_getaffinity(0,sizeof(maintenance_home),&maintenance_home);
+#endif
+    while(true){
+        timespec interval={maintenance_interval_ms/1000,(maintenance_interval_ms%1000)*1000000};
+        nanosleep(&interval,NULL);
+
+        long start=thread_cpu_us();
+        size_t first=maintenance_cursor;
+        do{
+            if(!maintenance_step(maintenance_cursor++))
+                maintenance_cursor=0;
+        }while(maintenance_cursor!=first && thread_cpu_us()-start<maintenance_budget_us);
     }
-    return data_to_add;
+    return NULL;
 }
 
+void start_maintenance(){
+    if(__atomic_load_n(&maintenance_started,__ATOMIC_RELAXED) || __atomic_exchange_n(&maintenance_started,1,__ATOMIC_ACQ_REL))
+        return;
+
+    maintenance_interval_ms=env_or("MALLOC_3_MAINTENANCE_MS",MAINTENANCE_INTERVAL_MS);
+    maintenance_budget_us=env_or("MALLOC_3_MAINTENANCE_BUDGET_US",MAINTENANCE_BUDGET_US);
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes,PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if(pthread_create(&thread,&attributes,maintenance_thread,NULL)!=0)
+        __atomic_store_n(&maintenance_started,0,__ATOMIC_RELEASE);     //the next new thread tries again
+    pthread_attr_destroy(&attributes);
+}
+#endif
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Fork-----------------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+/*
+ *   fork copies only the thread that calls it. A lock another thread (the maintenance thread, say) held
+ *   at that moment would stay held in the child forever, so fork takes every allocator lock first, in the
+ *   order the rest of the code nests them: arenas_lock, the arenas, the slab classes, the slab pool,
+ *   the mapped blocks, the CPU caches, the statistics slots. The parent and the child release them after.
+ */
+bool fork_watched=false;
+
+void fork_prepare(){
+    lock_acquire(&arenas_lock);
+    for(int index=0; index<num_arenas; index++)
+        lock_acquire(&arenas[index]->lock);
+#if SLAB_ALLOCATOR
+    for(int index=0; index<NUM_SLAB_CLASSES; index++)
+        lock_acquire(&slab_locks[index]);
+    lock_acquire(&slab_pool_lock);
+#endif
+    lock_acquire(&mmap_lock);
+#if PERCPU_RSEQ
+    lock_acquire(&cpu_caches_lock);
+#endif
+    pthread_mutex_lock(&stats_slots_mutex);
+}
+
+void fork_release(){
+    pthread_mutex_unlock(&stats_slots_mutex);
+#if PERCPU_RSEQ
+    lock_release(&cpu_caches_lock);
+#endif
+    lock_release(&mmap_lock);
+#if SLAB_ALLOCATOR
+    lock_release(&slab_pool_lock);
+    for(int index=NUM_SLAB_CLASSES-1; index>=0; index--)
+        lock_release(&slab_locks[index]);
+#endif
+    for(int index=num_arenas-1; index>=0; index--)
+        lock_release(&arenas[index]->lock);
+    lock_release(&arenas_lock);
+}
+
+void fork_child(){
+#if MAINTENANCE_THREAD
+    maintenance_started=0;                              //the child has no maintenance thread
+#endif
+    fork_release();
+}
+
+/*
+ *   Registers the handlers once, the first time a thread gets its arena.
+ */
+void watch_fork(){
+    if(__atomic_load_n(&fork_watched,__ATOMIC_RELAXED) || __atomic_exchange_n(&fork_watched,true,__ATOMIC_ACQ_REL))
+        return;
+    pthread_atfork(fork_prepare,fork_release,fork_child);
+}
 
 
 //--------------------------------------------------------------------------------------------------------//
@@ -217,38 +3317,47 @@ void* malloc(size_t size){
 
     if(SIZE_NOT_ALIGNED(size))
         size+=ALIGN_SIZE(size);
-
-
-    meta_data* ptr=find_first_fitting_place(size);
-    if (ptr!=NULL){                                     //ptr = existing meta data that is currently free
-//        ptr->current_size=size;
-        ptr->is_free=false;
-        return ptr->start_of_alloc;
-    }
-    ptr=create_new_meta_data(size);                     //ptr = new meta_data, inserted last to the list
-    if(ptr==NULL)                                       //ptr = NULL, if sbrk doesnt succeed
-        return NULL;
-
-    ptr->is_free=false;                                 //mark that allocation succeeded
-    return ptr->start_of_alloc;
+    if(size<MIN_BLOCK_SIZE)
+        size=MIN_BLOCK_SIZE;
+
+#if TCACHE_COUNT
+    if(size<=TCACHE_MAX_SIZE)
+        return tcache_malloc(size);
+#endif
+    return shared_malloc(size);
 }
 
 
 void free(void* p){
-    meta_data* to_release=find_meta_data_by_user_ptr(p);
-    if(to_release!=NULL) {
-        to_release->is_free = true;
-        check_and_combine(to_release);
-    }
+    if(p==NULL)
+        return;
+
+#if TCACHE_COUNT
+    if(tcache_free(p))
+        return;
+#endif
+    shared_free(p);
 }
 
 
+/*
+ *   Memory the kernel just gave us (a new block, a wilderness growth, a mapping, trimmed pages) is zero already,
+ *   the allocation paths mark such a block and only its dirty part is cleared.
+ */
 void* calloc(size_t num, size_t size){
+    if(size!=0 && num>MAX_SIZE/size)
+        return NULL;
+
+    zeroed_block=NULL;
     void* ptr = malloc(size*num);
     if(ptr==NULL)
         return NULL;
 
-    return std::memset(ptr, 0, size*num);
+    size_t dirty=size*num;
+    if(ptr==zeroed_block && zeroed_from<dirty)
+        dirty=zeroed_from;
+    zero_block(ptr, dirty);
+    return ptr;
 }
 
 void* realloc(void* oldp, size_t size){
@@ -257,44 +3366,117 @@ void* realloc(void* oldp, size_t size){
 
     if(SIZE_NOT_ALIGNED(size))
         size+=ALIGN_SIZE(size);
+    if(size<MIN_BLOCK_SIZE)
+        size=MIN_BLOCK_SIZE;
+
+    if(oldp==NULL)
+        return malloc(size);
+
+#if SLAB_ALLOCATOR
+    size_t object_index;
+    slab_page* page=lock_slab_page_by_user_ptr(oldp,&object_index);
+    if(page!=NULL)
+        return slab_realloc(page,oldp,size);
+#endif
 
+    arena* owner=find_arena(oldp);
+    if(owner==NULL)                                     //not in any arena, it may be a mapped block
+        return mmap_realloc(oldp,size);
+
+    lock_arena(owner);
     meta_data* old_meta_data=find_meta_data_by_user_ptr(oldp);
-    if(old_meta_data==NULL)                             //oldp is NULL or there is no meta_data that holds oldp
+    if(old_meta_data==NULL){                            //there is no meta_data that holds oldp
+        unlock_arena(owner);
         return malloc(size);
+    }
 
-    if(old_meta_data->block_size>=size){                 //there is enough space in old block for realloction
+    size_t wanted=size;                                 //with slack for a block that keeps growing
+#if REALLOC_SLACK
+    growth_slot* slot=watch_growth(old_meta_data);
+    wanted=plan_growth(slot,size);
+#endif
+
+    if(get_block_size(old_meta_data)>=size){                 //there is enough space in old block for realloction
 //        old_meta_data->current_size=size;
+#if REALLOC_SLACK
+        if(wanted>size){
+            slot->slack=true;                           //the slack stays for the next growth
+            unlock_arena(owner);
+            return oldp;
+        }
+#endif
         check_and_split(old_meta_data,size);
-        return old_meta_data->start_of_alloc;
+        unlock_arena(owner);
+        return oldp;
     }
 
+    meta_data* grown=NULL;
     if(old_meta_data==last_data){
-        if(SIZE_NOT_ALIGNED(size))
-            size+=ALIGN_SIZE(size);
-        if(!(wilderness_expand(size-old_meta_data->block_size)))  //if oldp==last_data we expand the block size of the last block
-            return NULL;
-        old_meta_data->block_size=size;
-        return old_meta_data->start_of_alloc;
-    }
-
-    if(old_meta_data->next_ptr->is_free==true ){                 //if we need to expand and next block is free
-        meta_data* retval=come_to_help_a_friend(old_meta_data,old_meta_data->next_ptr,(int)size);
-
-        if(retval!=NULL) {
-            return old_meta_data->start_of_alloc;
+        size_t target=wanted;                                   //if oldp==last_data we expand the block size of the last block
+        bool expanded=wilderness_expand(target-get_block_size(old_meta_data));
+        if(!expanded && wanted>size){
+            target=size;
+            expanded=wilderness_expand(target-get_block_size(old_meta_data));
+        }
+        if(expanded){
+            count_blocks(0,target-get_block_size(old_meta_data),0);
+            set_block_size(old_meta_data,target);
+            grown=old_meta_data;
+        }
+    }else{
+        meta_data* next=next_block(old_meta_data);
+        if(is_block_free(next)){                                //if we need to expand and next block is free
+            grown=come_to_help_a_friend(old_meta_data,next,wanted);
+            if(grown==NULL && wanted>size)
+                grown=come_to_help_a_friend(old_meta_data,next,size);
         }
     }
 
-    //if memcpy fails or there isn't enough space in oldp, we allocate a new block
-    void* new_start_of_alloc=malloc(size);
+    if(grown==NULL){                                        //the free block before oldp (and after it) may do
+        grown=expand_backward(old_meta_data,wanted);
+        if(grown==NULL && wanted>size && old_meta_data==last_data)     //no slack is better than no block
+            grown=expand_backward(old_meta_data,size);
+    }
+    if(grown!=NULL){
+#if REALLOC_SLACK
+        slot->block=grown;                              //expand_backward moves the header
+        slot->slack=wanted>size;
+#endif
+        unlock_arena(owner);
+        return get_start_of_alloc(grown);
+    }
+    size_t old_size=get_block_size(old_meta_data);
+#if REALLOC_SLACK
+    size_t grows=slot->grows;                           //the slot stays here, the new block may be in another arena
+#endif
+    unlock_arena(owner);                                    //oldp stays ours, it can be copied without the lock
+
+    //if there isn't enough space around oldp, we allocate a new block
+    void* new_start_of_alloc=malloc(wanted);
+    if(new_start_of_alloc==NULL && wanted>size){
+        wanted=size;
+        new_start_of_alloc=malloc(size);
+    }
     if(new_start_of_alloc==NULL)                             //if allocation failed we dont free oldp
         return NULL;
 
-    void* tmp_ptr=std::memcpy(new_start_of_alloc, old_meta_data->start_of_alloc, size);
-    if(tmp_ptr==NULL)
-        return NULL;
-
-    free(old_meta_data->start_of_alloc);                     //here we free the old space
+    copy_block(new_start_of_alloc, oldp, old_size);           //only old_size bytes of oldp are the user's
+
+    free(oldp);                                                  //here we free the old space
+#if REALLOC_SLACK
+    arena* new_owner=grows!=0 ? find_arena(new_start_of_alloc) : NULL;
+    if(new_owner!=NULL){                                //a heap block, the streak goes on with it
+        lock_arena(new_owner);
+        meta_data* moved=find_meta_data_by_user_ptr(new_start_of_alloc);
+        if(moved!=NULL){
+            slot=watch_growth(moved);
+            slot->requested=size;
+            slot->grows=grows;
+            slot->slack=wanted>size;
+        }
+        unlock_arena(new_owner);
+    }
+#endif
     return new_start_of_alloc;
 }
 
@@ -302,62 +3484,242 @@ void* realloc(void* oldp, size_t size){
 //-------------------------------------Underline Functions------------------------------------------------//
 //--------------------------------------------------------------------------------------------------------//
 
-size_t _num_free_blocks(){
-    meta_data* current=first_data;
-    size_t num_free_blocks=0;
-    while(current){
-        if(current->is_free)
-            num_free_blocks++;
-        current=current->next_ptr;
+/*
+ *   Statistics of all the arenas, the mapped blocks and the slabs.
+ */
+struct heap_stats{
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t allocated_blocks;
+    size_t allocated_bytes;
+    size_t meta_data_bytes;
+};
+
+void add_arena_stats(arena* counted, heap_stats* stats){
+    lock_arena(counted);
+    drain_remote_frees(counted);                        //what other threads freed is free
+    for(meta_data* current=first_data; current; current=next_block(current)){
+        if(is_block_free(current)){
+            stats->free_blocks++;
+            stats->free_bytes+=get_block_size(current);
+        }
+        stats->allocated_blocks++;
+        stats->allocated_bytes+=get_block_size(current);
+        stats->meta_data_bytes+=ALIGNED_META_DATA;
     }
+    unlock_arena(counted);
+}
 
-    return num_free_blocks;
+/*
+ *   Adds every thread's counters to totals, each thread's read while it held no lock.
+ *   Returns the sum of the sequences that were read.
+ */
+size_t sum_stats(long* totals){
+    size_t sequences=0;
+    for(stats_counters* counters=__atomic_load_n(&all_stats,__ATOMIC_ACQUIRE); counters; counters=counters->next_counters){
+        size_t sequence;
+        long counted[5];
+        do{
+            while((sequence=__atomic_load_n(&counters->sequence,__ATOMIC_ACQUIRE))%2!=0)
+                CPU_RELAX();
+            counted[0]=__atomic_load_n(&counters->free_blocks,__ATOMIC_RELAXED);
+            counted[1]=__atomic_load_n(&counters->free_bytes,__ATOMIC_RELAXED);
+            counted[2]=__atomic_load_n(&counters->allocated_blocks,__ATOMIC_RELAXED);
+            counted[3]=__atomic_load_n(&counters->allocated_bytes,__ATOMIC_RELAXED);
+            counted[4]=__atomic_load_n(&counters->meta_data_bytes,__ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        }while(__atomic_load_n(&counters->sequence,__ATOMIC_RELAXED)!=sequence);
+
+        for(int i=0; i<5; i++)
+            totals[i]+=counted[i];
+        sequences+=sequence;
+    }
+    return sequences;
 }
 
-size_t _num_free_bytes(){
-    meta_data* current=first_data;
-    size_t num_free_bytes=0;
+size_t sum_stats_sequences(){
+    size_t sequences=0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for(stats_counters* counters=__atomic_load_n(&all_stats,__ATOMIC_ACQUIRE); counters; counters=counters->next_counters)
+        sequences+=__atomic_load_n(&counters->sequence,__ATOMIC_ACQUIRE);
+    return sequences;
+}
 
-    while(current){
-        if(current->is_free)
-            num_free_bytes+=current->block_size;
+size_t stats_total(long total){
+    return total<0 ? 0 : (size_t)total;
+}
 
-        current=current->next_ptr;
+/*
+ *   Sums the counters of every thread (see Statistics Counters). A thread that is in the middle of an
+ *   operation is read again once its sequence is even and didn't move while it was read.
+ *   Blocks in a thread or CPU cache, or waiting on a lock-free or remote_frees stack, are in use
+ *   until they are given back.
+ */
+void collect_stats(heap_stats* stats){
+    long totals[5];
+    for(int pass=0; pass<STATS_PASSES; pass++){
+        for(int i=0; i<5; i++)
+            totals[i]=0;
+        if(sum_stats(totals)==sum_stats_sequences())      //no thread changed its counters during the pass
+            break;
     }
 
-    return num_free_bytes;
+    stats->free_blocks=stats_total(totals[0]);
+    stats->free_bytes=stats_total(totals[1]);
+    stats->allocated_blocks=stats_total(totals[2]);
+    stats->allocated_bytes=stats_total(totals[3]);
+    stats->meta_data_bytes=stats_total(totals[4]);
 }
 
-size_t _num_allocated_blocks(){
-    meta_data* current=first_data;
-    size_t num_blocks=0;
+void _stats_snapshot(heap_stats* stats){
+    collect_stats(stats);
+}
 
-    while(current){
-        num_blocks++;
-        current=current->next_ptr;
-    }
+size_t _num_free_blocks(){
+    heap_stats stats;
+    collect_stats(&stats);
+    return stats.free_blocks;
+}
+
+size_t _num_free_bytes(){
+    heap_stats stats;
+    collect_stats(&stats);
+    return stats.free_bytes;
+}
 
-    return num_blocks;
+size_t _num_allocated_blocks(){
+    heap_stats stats;
+    collect_stats(&stats);
+    return stats.allocated_blocks;
 }
 
 size_t _num_allocated_bytes(){
-    meta_data* current=first_data;
-    size_t num_allocated_bytes=0;
+    heap_stats stats;
+    collect_stats(&stats);
+    return stats.allocated_bytes;
+}
 
-    while(current){
-        num_allocated_bytes+=current->block_size;
-        current=current->next_ptr;
-    }
+size_t _num_meta_data_bytes(){
+    heap_stats stats;
+    collect_stats(&stats);
+    return stats.meta_data_bytes;
+}
 
-    return num_allocated_bytes;
+size_t _num_arenas(){
+    return __atomic_load_n(&num_arenas,__ATOMIC_ACQUIRE);
 }
 
-size_t _num_meta_data_bytes(){
-    return (_num_allocated_blocks() * sizeof(meta_data));
+/*
+ *   Statistics of one arena (0 is the main arena), false if there is no such arena.
+ *   Unlike the totals, they come from a walk of the arena under its lock.
+ */
+bool _arena_stats(size_t index, heap_stats* stats){
+    if(index>=_num_arenas())
+        return false;
+
+#if LOCKFREE_LISTS
+    flush_lockfree_stacks();
+#endif
+    std::memset(stats,0,sizeof(*stats));
+    add_arena_stats(arenas[index],stats);
+    return true;
 }
 
 size_t _size_meta_data(){
-    return sizeof(meta_data);
+    return ALIGNED_META_DATA;
+}
+
+#if TCACHE_COUNT
+size_t _num_tcache_hits(){
+    publish_tcache_hits();
+    return __atomic_load_n(&tcache_hits,__ATOMIC_RELAXED);
+}
+
+size_t _num_tcache_misses(){
+    return __atomic_load_n(&tcache_misses,__ATOMIC_RELAXED);
+}
+#endif
+
+#if MAINTENANCE_THREAD
+size_t _num_trims(){
+    return __atomic_load_n(&num_trims,__ATOMIC_RELAXED);
+}
+#endif
+
+size_t _num_syscalls(){
+    return __atomic_load_n(&num_syscalls,__ATOMIC_RELAXED);
+}
+
+struct lock_stats{
+    size_t acquisitions;
+    size_t contentions;
+    size_t sleeps;
+    size_t wait_ns;
+    size_t max_wait_ns;
+};
+
+void add_lock_counters(allocator_lock* lock, lock_stats* stats){
+    stats->acquisitions+=__atomic_load_n(&lock->acquisitions,__ATOMIC_RELAXED);
+    stats->contentions+=__atomic_load_n(&lock->contentions,__ATOMIC_RELAXED);
+    stats->sleeps+=__atomic_load_n(&lock->sleeps,__ATOMIC_RELAXED);
+    stats->wait_ns+=__atomic_load_n(&lock->wait_ns,__ATOMIC_RELAXED);
+    size_t max_wait_ns=__atomic_load_n(&lock->max_wait_ns,__ATOMIC_RELAXED);
+    if(max_wait_ns>stats->max_wait_ns)
+        stats->max_wait_ns=max_wait_ns;
+}
+
+/*
+ *   which is LOCK_HEAP (all the arenas), LOCK_MMAP or LOCK_SLAB (all the slab locks together).
+ */
+void lock_counters(int which, lock_stats* stats){
+    std::memset(stats,0,sizeof(*stats));
+    if(which==LOCK_HEAP){
+        int count=__atomic_load_n(&num_arenas,__ATOMIC_ACQUIRE);
+        for(int index=0; index<count; index++)
+            add_lock_counters(&arenas[index]->lock,stats);
+    }
+    if(which==LOCK_MMAP)
+        add_lock_counters(&mmap_lock,stats);
+#if SLAB_ALLOCATOR
+    if(which==LOCK_SLAB){
+        add_lock_counters(&slab_pool_lock,stats);
+        for(int index=0; index<NUM_SLAB_CLASSES; index++)
+            add_lock_counters(&slab_locks[index],stats);
+    }
+#endif
+}
+
+size_t _num_lock_acquisitions(int which){
+    lock_stats stats;
+    lock_counters(which,&stats);
+    return stats.acquisitions;
+}
+
+size_t _num_lock_contentions(int which){
+    lock_stats stats;
+    lock_counters(which,&stats);
+    return stats.contentions;
+}
+
+size_t _num_lock_sleeps(int which){
+    lock_stats stats;
+    lock_counters(which,&stats);
+    return stats.sleeps;
+}
+
+/*
+ *   Nanoseconds the contended acquires waited, in total and the longest one.
+ */
+size_t _lock_wait_ns(int which){
+    lock_stats stats;
+    lock_counters(which,&stats);
+    return stats.wait_ns;
+}
+
+size_t _lock_max_wait_ns(int which){
+    lock_stats stats;
+    lock_counters(which,&stats);
+    return stats.max_wait_ns;
 }
 
 //--------------------------------------------------------------------------------------------------------//
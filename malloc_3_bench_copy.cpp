@@ -0,0 +1,110 @@
+/*
+g++ -O2 malloc_3_bench_copy.cpp -o bench_copy
+
+./bench_copy
+
+Compares the allocator's copy_block and zero_block (the realloc and calloc kernels) with libc's memcpy and memset.
+For every size it prints the bandwidth of each, and how long re-reading a WORKING_SET bytes array that was hot
+before the copy takes after it: the kernels stream past the caches, so the working set should stay hot.
+Sizes below STREAM_THRESHOLD go to libc in both columns.
+ */
+
+#include <cstdio>
+#include <ctime>
+#include "malloc_3.cpp"
+
+#define MAX_BLOCK ((size_t)64<<20)
+#define WORKING_SET (256*1024)
+#define ROUNDS 8
+
+char* block_from;
+char* block_to;
+char* working_set;
+
+long now_ns(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000L+ts.tv_nsec;
+}
+
+size_t read_working_set(){
+    size_t sum=0;
+    for(size_t i=0; i<WORKING_SET; i+=64)
+        sum+=working_set[i];
+    return sum;
+}
+
+void libc_copy(size_t size){
+    std::memcpy(block_to,block_from,size);
+}
+
+void kernel_copy(size_t size){
+    copy_block(block_to,block_from,size);
+}
+
+void libc_zero(size_t size){
+    std::memset(block_to,0,size);
+}
+
+void kernel_zero(size_t size){
+    zero_block(block_to,size);
+}
+
+/*
+ *   Prints GB/s of op over size bytes and ns to read the working set after it, best of ROUNDS.
+ */
+size_t sink=0;
+void measure(void (*op)(size_t), size_t size){
+    long best_op=-1;
+    long best_read=-1;
+    for(int round=0; round<ROUNDS; round++){
+        sink+=read_working_set();
+        long start=now_ns();
+        op(size);
+        long middle=now_ns();
+        sink+=read_working_set();
+        long end=now_ns();
+        if(best_op<0 || middle-start<best_op)
+            best_op=middle-start;
+        if(best_read<0 || end-middle<best_read)
+            best_read=end-middle;
+    }
+    printf("  %7.2f GB/s %7ld ns",(double)size/best_op,best_read);
+}
+
+int main(){
+    block_from=(char*)mmap(NULL,MAX_BLOCK,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    block_to=(char*)mmap(NULL,MAX_BLOCK,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    working_set=(char*)mmap(NULL,WORKING_SET,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(block_from==MAP_FAILED || block_to==MAP_FAILED || working_set==MAP_FAILED)
+        return 1;
+    std::memset(block_from,1,MAX_BLOCK);
+    std::memset(block_to,2,MAX_BLOCK);                  //no page faults in the timed part
+    std::memset(working_set,3,WORKING_SET);
+
+#if defined(__x86_64__)
+    const char* levels[]={"", "sse2", "avx2", "avx512"};
+    printf("kernel: %s  threshold: %d  working set read after the op\n",levels[get_stream_level()],STREAM_THRESHOLD);
+#endif
+    printf("%10s  %-30s%-30s%-30s%-30s\n","size","memcpy","copy_block","memset","zero_block");
+    for(size_t size=64*1024; size<=MAX_BLOCK; size*=2){
+        printf("%10zu",size);
+        measure(libc_copy,size);
+        measure(kernel_copy,size);
+        measure(libc_zero,size);
+        measure(kernel_zero,size);
+        printf("\n");
+    }
+
+    for(size_t i=0; i<MAX_BLOCK; i+=4099)               //the kernels copied what libc did
+        if(block_to[i]!=0){
+            printf("wrong fill at %zu\n",i);
+            return 1;
+        }
+    copy_block(block_to+5,block_from+3,MAX_BLOCK-13);   //unaligned on both sides, with a tail
+    if(std::memcmp(block_to+5,block_from+3,MAX_BLOCK-13)!=0 || block_to[4]!=0 || block_to[MAX_BLOCK-8]!=0){
+        printf("wrong copy\n");
+        return 1;
+    }
+    return sink==0;
+}
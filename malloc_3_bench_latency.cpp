@@ -0,0 +1,76 @@
+/*
+g++ -O2 malloc_3_bench_latency.cpp -o bench_seg
+g++ -O2 -DFIT_POLICY=TLSF_FIT malloc_3_bench_latency.cpp -o bench_tlsf
+g++ -O2 -DFIT_POLICY=BEST_FIT malloc_3_bench_latency.cpp -o bench_best
+
+Measures malloc/free latency while the number of live blocks grows.
+With TLSF_FIT the p99.9 column should stay flat.
+ */
+
+#include <cstdio>
+#include <ctime>
+#include <algorithm>
+#include "malloc_3.cpp"
+
+#define SAMPLES 100000
+#define MAX_LIVE 1000000
+
+void* live[MAX_LIVE];
+long malloc_ns[SAMPLES];
+long free_ns[SAMPLES];
+
+unsigned long long seed=88172645463325252ULL;
+unsigned long long next_random(){
+    seed^=seed<<13;
+    seed^=seed>>7;
+    seed^=seed<<17;
+    return seed;
+}
+
+size_t random_size(){
+    if(next_random()%8)
+        return 8+next_random()%248;         //mostly small blocks
+    return 256+next_random()%8192;
+}
+
+long now_ns(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000L+ts.tv_nsec;
+}
+
+void print_percentiles(const char* name, long* samples){
+    std::sort(samples,samples+SAMPLES);
+    printf("  %-6s p50 %6ld  p99 %6ld  p99.9 %7ld  max %8ld ns\n",name,
+           samples[SAMPLES/2],samples[SAMPLES*99/100],samples[SAMPLES*999/1000],samples[SAMPLES-1]);
+}
+
+int main(){
+    printf("fit policy: %s\n",FIT_POLICY==TLSF_FIT ? "TLSF_FIT" : FIT_POLICY==BEST_FIT ? "BEST_FIT" : "SEGREGATED_FIT");
+
+    size_t num_live=0;
+    for(size_t target=1000; target<=MAX_LIVE; target*=10){
+        while(num_live<target)                   //grow the heap, then punch holes in it
+            live[num_live++]=malloc(random_size());
+        for(size_t i=0; i<num_live; i+=3)
+            free(live[i]);
+        for(size_t i=0; i<num_live; i+=3)
+            live[i]=malloc(random_size());
+
+        for(int i=0; i<SAMPLES; i++){
+            size_t index=next_random()%num_live;
+            long start=now_ns();
+            free(live[index]);
+            long middle=now_ns();
+            live[index]=malloc(random_size());
+            long end=now_ns();
+            free_ns[i]=middle-start;
+            malloc_ns[i]=end-middle;
+        }
+
+        printf("live blocks %zu (free blocks %zu)\n",num_live,_num_free_blocks());
+        print_percentiles("malloc",malloc_ns);
+        print_percentiles("free",free_ns);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+g++ -O2 malloc_3_bench_thread_churn.cpp -o churn -lpthread
+g++ -O2 -DTCACHE_COUNT=16 malloc_3_bench_thread_churn.cpp -o churn_tcache -lpthread
+
+Spawns and joins ROUNDS rounds of THREADS_PER_ROUND threads. Every thread allocates blocks, frees most
+of them, fills its thread cache, and hands KEPT_BLOCKS blocks to the main thread, which frees them
+in the next round. After a few warm-up rounds the RSS must stop growing:
+the program fails if it grows by more than RSS_SLACK_KB after round WARMUP_ROUNDS.
+ */
+
+#include <cstdio>
+#include "malloc_3.cpp"
+
+#define ROUNDS 40
+#define THREADS_PER_ROUND 100
+#define WARMUP_ROUNDS 5
+#define BLOCKS_PER_THREAD 400
+#define KEPT_BLOCKS 20
+#define RSS_SLACK_KB 4096
+
+void* kept[THREADS_PER_ROUND][KEPT_BLOCKS];
+
+long rss_kb(){
+    long pages=0, resident=0;
+    FILE* statm=fopen("/proc/self/statm","r");
+    if(statm==NULL)
+        return 0;
+    if(fscanf(statm,"%ld %ld",&pages,&resident)!=2)
+        resident=0;
+    fclose(statm);
+    return resident*(sysconf(_SC_PAGESIZE)/1024);
+}
+
+void* worker(void* arg){
+    size_t id=(size_t)arg;
+    unsigned long long seed=88172645463325252ULL+id;
+    void* blocks[BLOCKS_PER_THREAD];
+    for(int i=0; i<BLOCKS_PER_THREAD; i++){
+        seed^=seed<<13;
+        seed^=seed>>7;
+        seed^=seed<<17;
+        blocks[i]=malloc(8+seed%(seed%16==0 ? 8192 : 512));
+    }
+    for(int i=0; i<BLOCKS_PER_THREAD; i++){
+        if(i<KEPT_BLOCKS)
+            kept[id][i]=blocks[i];                  //freed by the main thread, after this thread is gone
+        else
+            free(blocks[i]);                        //the small ones stay in the thread cache
+    }
+    return NULL;
+}
+
+int main(){
+    pthread_t threads[THREADS_PER_ROUND];
+    long warm_rss=0;
+    for(int round=0; round<ROUNDS; round++){
+        for(size_t i=0; i<THREADS_PER_ROUND; i++)
+            pthread_create(&threads[i],NULL,worker,(void*)i);
+        for(int i=0; i<THREADS_PER_ROUND; i++)
+            pthread_join(threads[i],NULL);
+        for(int i=0; i<THREADS_PER_ROUND; i++){
+            for(int j=0; j<KEPT_BLOCKS; j++)
+                free(kept[i][j]);
+        }
+
+        long rss=rss_kb();
+        if(round==WARMUP_ROUNDS)
+            warm_rss=rss;
+        if(round%5==4)
+            printf("round %2d  threads %5d  rss %6ld KB  arenas %zu  allocated %zu KB  free %zu KB\n",round+1,
+                   (round+1)*THREADS_PER_ROUND,rss,_num_arenas(),_num_allocated_bytes()/1024,_num_free_bytes()/1024);
+    }
+
+    long final_rss=rss_kb();
+    if(final_rss>warm_rss+RSS_SLACK_KB){
+        printf("FAIL: rss grew from %ld KB to %ld KB\n",warm_rss,final_rss);
+        return 1;
+    }
+    printf("OK: rss %ld KB after warm-up, %ld KB at the end\n",warm_rss,final_rss);
+    return 0;
+}
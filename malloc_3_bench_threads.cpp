@@ -0,0 +1,78 @@
+/*
+g++ -O2 malloc_3_bench_threads.cpp -o bench_locked -lpthread
+g++ -O2 -DLOCKFREE_LISTS=1 malloc_3_bench_threads.cpp -o bench_lockfree -lpthread
+g++ -O2 -DTCACHE_COUNT=16 malloc_3_bench_threads.cpp -o bench_tcache -lpthread
+g++ -O2 -DPERCPU_CACHE=1 malloc_3_bench_threads.cpp -o bench_percpu -lpthread
+
+MALLOC_3_ARENAS=1 ./bench_lockfree
+
+Measures malloc/free throughput of small blocks with 1 to MAX_THREADS threads.
+Every thread keeps WINDOW live blocks and replaces a random one OPS_PER_THREAD times.
+With MALLOC_3_ARENAS=1 all the threads share one arena, so the locked build shows
+the arena lock and the lock-free build shows the stacks.
+ */
+
+#include <cstdio>
+#include <ctime>
+#include "malloc_3.cpp"
+
+#define MAX_THREADS 64
+#define OPS_PER_THREAD 200000
+#define WINDOW 64
+
+pthread_barrier_t start_barrier;
+
+long now_ns(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000L+ts.tv_nsec;
+}
+
+void* worker(void* arg){
+    unsigned long long seed=88172645463325252ULL+(size_t)arg;
+    void* live[WINDOW];
+    for(int i=0; i<WINDOW; i++)
+        live[i]=malloc(8+seed%248);
+
+    pthread_barrier_wait(&start_barrier);
+    for(int i=0; i<OPS_PER_THREAD; i++){
+        seed^=seed<<13;
+        seed^=seed>>7;
+        seed^=seed<<17;
+        size_t index=seed%WINDOW;
+        free(live[index]);
+        live[index]=malloc(8+(seed>>8)%248);
+    }
+
+    for(int i=0; i<WINDOW; i++)
+        free(live[i]);
+    return NULL;
+}
+
+int main(){
+    printf("lock-free lists: %d  thread cache: %d  per CPU: %d\n",LOCKFREE_LISTS,TCACHE_COUNT,PERCPU_CACHE);
+
+    pthread_t threads[MAX_THREADS];
+    for(int num_threads=1; num_threads<=MAX_THREADS; num_threads*=2){
+        size_t contentions=_num_lock_contentions(LOCK_HEAP);
+        size_t sleeps=_num_lock_sleeps(LOCK_HEAP);
+        size_t wait_ns=_lock_wait_ns(LOCK_HEAP);
+        pthread_barrier_init(&start_barrier,NULL,num_threads+1);
+        for(int i=0; i<num_threads; i++)
+            pthread_create(&threads[i],NULL,worker,(void*)(size_t)i);
+
+        pthread_barrier_wait(&start_barrier);
+        long start=now_ns();
+        for(int i=0; i<num_threads; i++)
+            pthread_join(threads[i],NULL);
+        long elapsed=now_ns()-start;
+        pthread_barrier_destroy(&start_barrier);
+
+        double ops=2.0*OPS_PER_THREAD*num_threads;
+        contentions=_num_lock_contentions(LOCK_HEAP)-contentions;
+        printf("threads %2d  %8.2f Mops/s  %6.1f ns/op per thread  heap lock contentions %zu (slept %zu, %.0f ns avg)\n",
+               num_threads,ops*1000/elapsed,(double)elapsed*num_threads/ops,contentions,_num_lock_sleeps(LOCK_HEAP)-sleeps,
+               contentions==0 ? 0.0 : (double)(_lock_wait_ns(LOCK_HEAP)-wait_ns)/contentions);
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+g++ malloc_3_meta_overhead.cpp -o overhead_list
+g++ -DBOUNDARY_TAGS=1 malloc_3_meta_overhead.cpp -o overhead_tags
+g++ -DCOMPACT_HEADER=1 malloc_3_meta_overhead.cpp -o overhead_compact
+
+./overhead_compact [trace_file]
+
+Replays an allocation trace and prints how much of the heap is meta data.
+Trace lines are "a <id> <size>" (malloc) and "f <id>" (free), ids are below MAX_IDS.
+Without a trace file a synthetic small-object trace is replayed.
+ */
+
+#include <cstdio>
+#include "malloc_3.cpp"
+
+#define MAX_IDS 1000000
+#define SYNTHETIC_OPS 400000
+
+void* blocks[MAX_IDS];
+
+unsigned long long seed=88172645463325252ULL;
+unsigned long long next_random(){
+    seed^=seed<<13;
+    seed^=seed>>7;
+    seed^=seed<<17;
+    return seed;
+}
+
+size_t synthetic_size(){
+    int kind=next_random()%100;
+    if(kind<70)
+        return 8+next_random()%56;
+    if(kind<95)
+        return 64+next_random()%448;
+    return 512+next_random()%7680;
+}
+
+void apply(char op, long id, size_t size){
+    if(id<0 || id>=MAX_IDS)
+        return;
+    if(op=='a'){
+        free(blocks[id]);
+        blocks[id]=malloc(size);
+    }else if(op=='f'){
+        free(blocks[id]);
+        blocks[id]=NULL;
+    }
+}
+
+int main(int argc, char** argv){
+    if(argc>1){
+        FILE* trace=fopen(argv[1],"r");
+        if(trace==NULL){
+            printf("can't open %s\n",argv[1]);
+            return 1;
+        }
+        char op;
+        long id;
+        size_t size=0;
+        while(fscanf(trace," %c %ld",&op,&id)==2){
+            if(op=='a' && fscanf(trace,"%zu",&size)!=1)
+                break;
+            apply(op,id,size);
+        }
+        fclose(trace);
+    }else{
+        for(long i=0; i<SYNTHETIC_OPS; i++){
+            long id=next_random()%(SYNTHETIC_OPS/4);
+            apply(next_random()%3 ? 'a' : 'f',id,synthetic_size());
+        }
+    }
+
+    size_t meta_bytes=_num_meta_data_bytes();
+    size_t data_bytes=_num_allocated_bytes();
+    printf("layout: %s\n",COMPACT_HEADER ? "COMPACT_HEADER" : BOUNDARY_TAGS ? "BOUNDARY_TAGS" : "list");
+    printf("_size_meta_data      %zu\n",_size_meta_data());
+    printf("blocks               %zu (%zu free)\n",_num_allocated_blocks(),_num_free_blocks());
+    printf("_num_meta_data_bytes %zu\n",meta_bytes);
+    printf("_num_allocated_bytes %zu\n",data_bytes);
+    printf("meta data overhead   %.1f%%\n",100.0*meta_bytes/(meta_bytes+data_bytes));
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+g++ -O2 malloc_3_tests_arenas.cpp -o t -lpthread && ./t
+
+Arenas: the first thread has the main arena, every new thread gets an arena of its own until there
+are arena_limit of them, then it shares the arena with the fewest threads. The arena of a thread that
+exited is an orphan: its blocks can still be freed by anyone, a thread that finds no fitting block in
+its own arena takes one from an orphan, and the next new thread gets the orphan itself.
+arena_limit is set by the test, so it doesn't depend on the number of CPUs.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include "malloc_3.cpp"
+
+#define LIMIT 3
+
+pthread_barrier_t allocated_barrier;
+pthread_barrier_t exit_barrier;
+void* left[LIMIT];                  //a block every thread leaves behind, and one after it
+void* guard[LIMIT];
+
+void* allocate_and_exit(void* arg){
+    size_t index=(size_t)arg;
+    left[index]=malloc(1000);
+    guard[index]=malloc(100);
+    pthread_barrier_wait(&allocated_barrier);
+    pthread_barrier_wait(&exit_barrier);
+    return NULL;
+}
+
+void* allocate(void* arg){
+    *(void**)arg=malloc(1000);
+    return NULL;
+}
+
+int main() {
+
+    arena_limit=LIMIT;
+
+    void* own=malloc(1000);
+    assert(_num_arenas() == 1);
+    assert(find_arena(own) == &main_arena);
+
+    // LIMIT threads live at once: two get new arenas, the third shares one
+    pthread_barrier_init(&allocated_barrier,NULL,LIMIT+1);
+    pthread_barrier_init(&exit_barrier,NULL,LIMIT+1);
+    pthread_t threads[LIMIT];
+    for(size_t i=0; i<LIMIT; i++)
+        assert(pthread_create(&threads[i],NULL,allocate_and_exit,(void*)i) == 0);
+    pthread_barrier_wait(&allocated_barrier);
+    assert(_num_arenas() == LIMIT);
+    assert(find_arena(left[0]) == arenas[1] && find_arena(guard[0]) == arenas[1]);
+    assert(find_arena(left[1]) == arenas[2] && find_arena(guard[1]) == arenas[2]);
+    assert(find_arena(left[2]) != NULL);
+    assert(arenas[0]->num_threads + arenas[1]->num_threads + arenas[2]->num_threads == LIMIT + 1);
+
+    pthread_barrier_wait(&exit_barrier);
+    for(int i=0; i<LIMIT; i++)
+        pthread_join(threads[i],NULL);
+    assert(arenas[1]->orphaned && arenas[2]->orphaned);
+    assert(num_orphans == 2);
+
+    // blocks of an orphan are freed under its lock
+    size_t free_blocks=_num_free_blocks();
+    free(left[0]);
+    assert(_num_free_blocks() == free_blocks + 1);
+
+    // the main arena has no free block, the orphan's is taken before the main arena grows
+    void* taken=malloc(1000);
+    assert(taken == left[0]);
+    assert(_num_free_blocks() == free_blocks);
+
+    // a new thread gets an orphan, not a new arena
+    void* other=NULL;
+    pthread_t thread;
+    assert(pthread_create(&thread,NULL,allocate,&other) == 0);
+    pthread_join(thread,NULL);
+    assert(_num_arenas() == LIMIT);
+    assert(find_arena(other) == arenas[1] || find_arena(other) == arenas[2]);
+
+    free(other);
+    free(taken);
+    for(int i=0; i<LIMIT; i++){
+        if(i != 0)
+            free(left[i]);
+        free(guard[i]);
+    }
+    free(own);
+    printf("TEST FINISHED\n");
+    return 0;
+}
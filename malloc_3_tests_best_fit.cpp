@@ -0,0 +1,62 @@
+/*
+g++ -O2 malloc_3_tests_best_fit.cpp -o t && ./t
+
+The best fit policy: a request takes the smallest free block that fits, the lowest address among
+blocks of that size, whatever order the blocks were freed in.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#define FIT_POLICY BEST_FIT
+#include "malloc_3.cpp"
+
+int main() {
+
+    // free blocks of 5000, 3000, 4000, 3000 and 8000 bytes, a guard after each
+    size_t sizes[5] = {5000, 3000, 4000, 3000, 8000};
+    void* blocks[5];
+    void* guards[5];
+    for (int i = 0; i < 5; i++) {
+        blocks[i] = malloc(sizes[i]);
+        guards[i] = malloc(40);
+    }
+    free(blocks[4]);
+    free(blocks[0]);
+    free(blocks[3]);
+    free(blocks[2]);
+    free(blocks[1]);
+    assert(_num_free_blocks() == 5);
+
+    // (the requests leave too little of a block to split it)
+    // 3950 fits 5000, 4000 and 8000 best in 4000
+    assert(malloc(3950) == blocks[2]);
+    // the two 3000 blocks tie, the lower one goes first
+    assert(malloc(2990) == blocks[1]);
+    assert(malloc(3000) == blocks[3]);
+    // only 5000 and 8000 are left
+    assert(malloc(4950) == blocks[0]);
+    assert(_num_free_blocks() == 1);
+
+    // nothing fits 9000, the heap grows
+    size_t allocated_blocks = _num_allocated_blocks();
+    void* big = malloc(9000);
+    assert(big != blocks[4]);
+    assert(_num_allocated_blocks() == allocated_blocks + 1);
+    assert(_num_free_blocks() == 1);
+
+    // a split leaves the rest of the block in the tree, where it is found again
+    void* part = malloc(1000);
+    assert(part == blocks[4]);
+    assert(_num_free_blocks() == 1);
+    assert(_num_free_bytes() == 8000 - 1000 - _size_meta_data());
+
+    free(big);
+    free(part);
+    for (int i = 0; i < 4; i++)
+        free(blocks[i]);
+    for (int i = 0; i < 5; i++)
+        free(guards[i]);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+g++ -O2 malloc_3_tests_boundary_tags.cpp -o t && ./t
+g++ -O2 -DFIT_POLICY=BEST_FIT malloc_3_tests_boundary_tags.cpp -o t && ./t
+
+Boundary tags: a freed block merges with a free block on either side, found through its size and the
+footer before it, in any free order. The header is only what comes before the free links, and the links
+live in a free block's data, so a block in use keeps all of its data.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#define BOUNDARY_TAGS 1
+#include "malloc_3.cpp"
+
+void fill(void* p, size_t size, unsigned char value) {
+    for (size_t i = 0; i < size; i++)
+        ((unsigned char*)p)[i] = value;
+}
+
+bool filled(void* p, size_t size, unsigned char value) {
+    for (size_t i = 0; i < size; i++)
+        if (((unsigned char*)p)[i] != value)
+            return false;
+    return true;
+}
+
+int main() {
+
+    assert(_size_meta_data() == 3 * sizeof(size_t));
+
+    // a, b, c side by side, guards around them
+    void* g1 = malloc(100);
+    void* a = malloc(1000);
+    void* b = malloc(2000);
+    void* c = malloc(3000);
+    void* g2 = malloc(100);
+    fill(g1, 100, 1);
+    fill(g2, 100, 2);
+    size_t meta_data_bytes = _num_meta_data_bytes();
+
+    // a and c don't touch, b merges with both
+    free(a);
+    free(c);
+    assert(_num_free_blocks() == 2);
+    free(b);
+    assert(_num_free_blocks() == 1);
+    assert(_num_free_bytes() == 6000 + 2 * _size_meta_data());
+    assert(_num_meta_data_bytes() == meta_data_bytes - 2 * _size_meta_data());
+    assert(filled(g1, 100, 1) && filled(g2, 100, 2));
+
+    // the merged block is reused whole
+    void* all = malloc(6000 + 2 * _size_meta_data());
+    assert(all == a);
+    assert(_num_free_blocks() == 0);
+
+    // the other order: the middle first, then its neighbours merge into it
+    free(all);
+    a = malloc(1000);
+    b = malloc(2000);
+    c = malloc(3000);
+    assert(a == all && _num_free_blocks() == 0);
+    free(b);
+    free(a);
+    assert(_num_free_blocks() == 1);
+    assert(_num_free_bytes() == 3000 + _size_meta_data());
+    free(c);
+    assert(_num_free_blocks() == 1);
+    assert(_num_free_bytes() == 6000 + 2 * _size_meta_data());
+
+    // every byte of a block in use is the user's, the free links and footer of a free neighbour don't touch it
+    void* x = malloc(MIN_BLOCK_SIZE);
+    void* y = malloc(MIN_BLOCK_SIZE);
+    void* z = malloc(MIN_BLOCK_SIZE);
+    fill(x, MIN_BLOCK_SIZE, 3);
+    fill(y, MIN_BLOCK_SIZE, 4);
+    fill(z, MIN_BLOCK_SIZE, 5);
+    free(x);
+    free(z);
+    assert(filled(y, MIN_BLOCK_SIZE, 4));
+    assert(filled(g1, 100, 1) && filled(g2, 100, 2));
+
+    free(y);
+    free(g1);
+    free(g2);
+    printf("TEST FINISHED\n");
+    return 0;
+}
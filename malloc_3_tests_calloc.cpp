@@ -0,0 +1,64 @@
+/*
+g++ -O2 malloc_3_tests_calloc.cpp -o t && ./t
+
+calloc clears only what may be dirty: a block carved from fresh heap or a new mapping is known zero and
+is not cleared at all, the wilderness grown under a free last block is cleared up to its old size, and
+a reused block is cleared whole. Whatever it skips, every byte it returns is zero. A count times size
+that overflows is refused.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include <stdint.h>
+#include "malloc_3.cpp"
+
+bool zeroed(void* p, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        if (((unsigned char*)p)[i] != 0)
+            return false;
+    return true;
+}
+
+int main() {
+
+    volatile size_t huge = SIZE_MAX / 2;                //not known to the compiler, which would warn
+    assert(calloc(huge, 4) == NULL);
+    assert(calloc(4, huge) == NULL);
+    assert(calloc(0, 100) == NULL);
+
+    // fresh heap
+    void* fresh = calloc(1000, 4);
+    assert(zeroed_block == fresh && zeroed_from == 0);
+    assert(zeroed(fresh, 4000));
+
+    // a reused block was dirty
+    void* guard = malloc(100);
+    memset(fresh, 0xab, 4000);
+    free(fresh);
+    void* reused = calloc(4000, 1);
+    assert(reused == fresh);
+    assert(zeroed_from == 4000);
+    assert(zeroed(reused, 4000));
+
+    // a free, dirty last block grows with the wilderness, only its old bytes are cleared
+    void* last = malloc(2000);
+    memset(last, 0xcd, 2000);
+    free(last);
+    void* grown = calloc(5000, 1);
+    assert(grown == last);
+    assert(zeroed_from == 2000);
+    assert(zeroed(grown, 5000));
+
+    // a new mapping
+    void* mapped = calloc(MMAP_THRESHOLD + 1000, 1);
+    assert(find_arena(mapped) == NULL);
+    assert(zeroed_block == mapped && zeroed_from == 0);
+    assert(zeroed(mapped, MMAP_THRESHOLD + 1000));
+
+    free(mapped);
+    free(grown);
+    free(reused);
+    free(guard);
+    printf("TEST FINISHED\n");
+    return 0;
+}
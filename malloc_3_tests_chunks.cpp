@@ -0,0 +1,55 @@
+/*
+g++ -O2 malloc_3_tests_chunks.cpp -o t && ./t
+
+Heap growth by chunks: the program break moves by whole HEAP_CHUNK_SIZE chunks, and the blocks carved
+from the reserved tail cost no syscall. Blocks are still carved side by side.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include <unistd.h>
+
+#define HEAP_CHUNK_SIZE 65536
+#include "malloc_3.cpp"
+
+int main() {
+
+    char* start = (char*)sbrk(0);
+    char* first = (char*)malloc(100);
+    char* program_break = (char*)sbrk(0);
+    assert(program_break - start == HEAP_CHUNK_SIZE);
+
+    // 100 blocks fit the chunk, none of them moves the break
+    size_t syscalls = _num_syscalls();
+    char* blocks[100];
+    for (int i = 0; i < 100; i++) {
+        blocks[i] = (char*)malloc(500);
+        assert(blocks[i] != NULL);
+        if (i > 0)
+            assert(blocks[i] - blocks[i - 1] == (long)(500 + _size_meta_data()));
+    }
+    assert(_num_syscalls() == syscalls);
+    assert((char*)sbrk(0) == program_break);
+
+    // past the chunk, the break moves by whole chunks, once
+    char* big = (char*)malloc(100000);
+    assert(big == blocks[99] + 500 + _size_meta_data());
+    assert(_num_syscalls() == syscalls + 1);
+    char* grown = (char*)sbrk(0);
+    assert((grown - start) % HEAP_CHUNK_SIZE == 0);
+    assert(big + 100000 <= grown && grown - (big + 100000) < HEAP_CHUNK_SIZE);
+
+    // the wilderness grows in the reserved tail too
+    char* last = (char*)malloc(200);
+    syscalls = _num_syscalls();
+    assert(realloc(last, 200 + (grown - last) / 2) == last);
+    assert(_num_syscalls() == syscalls);
+
+    free(last);
+    free(big);
+    for (int i = 0; i < 100; i++)
+        free(blocks[i]);
+    free(first);
+    printf("TEST FINISHED\n");
+    return 0;
+}
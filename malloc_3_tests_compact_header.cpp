@@ -0,0 +1,57 @@
+/*
+g++ -O2 malloc_3_tests_compact_header.cpp -o t && ./t
+
+The compact header: 16 bytes per block, the flags packed in the size. A pointer is a block only if the
+header before it has the check word of its own address, so pointers into a block's data are ignored,
+even where the data looks like a header.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#define COMPACT_HEADER 1
+#include "malloc_3.cpp"
+
+int main() {
+
+    assert(_size_meta_data() == 16);
+    assert(BOUNDARY_TAGS);
+
+    size_t meta_data_bytes = _num_meta_data_bytes();
+    void* a = malloc(1000);
+    void* b = malloc(1000);
+    void* guard = malloc(100);
+    assert((char*)b - (char*)a == 1000 + 16);
+    assert(_num_meta_data_bytes() == meta_data_bytes + 3 * 16);
+
+    // a fake header in a's data: a size and a check word that isn't its address ^ CHECK_MAGIC
+    size_t* fake = (size_t*)((char*)a + 64);
+    fake[0] = 512;
+    fake[1] = 0x1234;
+    size_t free_blocks = _num_free_blocks();
+    free(fake + 2);
+    free((char*)a + 8);
+    assert(_num_free_blocks() == free_blocks);
+
+    // the flags in the size: b is free, a sees it as its free next neighbour
+    free(b);
+    assert(_num_free_blocks() == free_blocks + 1);
+    assert(_num_free_bytes() == 1000);
+    free(a);
+    assert(_num_free_blocks() == free_blocks + 1);
+    assert(_num_free_bytes() == 2000 + 16);
+    assert(_num_meta_data_bytes() == meta_data_bytes + 2 * 16);
+
+    // a header absorbed by the merge is not a block any more
+    free_blocks = _num_free_blocks();
+    free(b);
+    assert(_num_free_blocks() == free_blocks);
+
+    void* merged = malloc(2000);
+    assert(merged == a);
+
+    free(merged);
+    free(guard);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+g++ -O2 malloc_3_tests_lockfree.cpp -o t -lpthread && ./t
+
+The lock-free stacks: a freed small block waits on the stack of its class, still in use, and is the
+next block of that class for any thread. Every pop bumps the tag of the head, so a stale head fails its
+CAS. A second free of a stacked block gives the stack back to the arenas and is then ignored, a stack
+holds at most LOCKFREE_COUNT blocks, and threads pushing and popping one stack at once never get the
+same block twice.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#define LOCKFREE_LISTS 1
+#include "malloc_3.cpp"
+
+#define NUM_THREADS 8
+#define STEPS 1000000
+#define WINDOW 16
+
+lockfree_stack* stack_of(size_t size){
+    return &lockfree_stacks[(size-1)/LOCKFREE_CLASS_STEP];
+}
+
+void* churn(void* arg){
+    unsigned int state=(unsigned int)(size_t)arg+1;
+    unsigned char* window[WINDOW]={};
+    unsigned char mark=(unsigned char)(size_t)arg;
+    for(int step=0; step<STEPS; step++){
+        state=state*1103515245+12345;
+        int index=(state>>8)%WINDOW;
+        if(window[index]!=NULL){
+            for(int i=16; i<80; i++)                    //the first two words are the link and the key
+                assert(window[index][i]==mark);
+            free(window[index]);
+        }
+        window[index]=(unsigned char*)malloc(80+(state>>16)%17);     //blocks of two classes
+        for(int i=0; i<80; i++)
+            window[index][i]=mark;
+    }
+    for(int index=0; index<WINDOW; index++)
+        free(window[index]);
+    return NULL;
+}
+
+int main() {
+
+    // a freed block is pushed, it is still in use
+    void* p=malloc(48);
+    void* guard=malloc(48);
+    lockfree_stack* stack=stack_of(48);
+    size_t free_blocks=_num_free_blocks();
+    free(p);
+    assert(LOCKFREE_TOP(stack->head) == p && stack->count == 1);
+    assert(((void**)p)[1] == (void*)LOCKFREE_KEY);
+    assert(_num_free_blocks() == free_blocks);
+
+    // a pop bumps the tag
+    unsigned long long tag=LOCKFREE_TAG(stack->head);
+    assert(malloc(48) == p);
+    assert(LOCKFREE_TOP(stack->head) == NULL && LOCKFREE_TAG(stack->head) == tag + 1);
+
+    // a double free flushes the stack to the arena, the block is freed once
+    free(p);
+    free(p);
+    assert(LOCKFREE_TOP(stack->head) == NULL && stack->count == 0);
+    assert(_num_free_blocks() == free_blocks + 1);
+    assert(malloc(48) == p);
+    assert(_num_free_blocks() == free_blocks);
+
+    // a full stack leaves the rest to the arenas
+    static void* blocks[LOCKFREE_COUNT + 100];
+    for(int i=0; i<LOCKFREE_COUNT + 100; i++)
+        blocks[i]=malloc(208);
+    for(int i=0; i<LOCKFREE_COUNT + 100; i++)
+        free(blocks[i]);
+    assert(stack_of(208)->count == LOCKFREE_COUNT);
+    assert(_num_free_blocks() > free_blocks);
+
+    // threads share one stack
+    pthread_t threads[NUM_THREADS];
+    for(size_t i=0; i<NUM_THREADS; i++)
+        assert(pthread_create(&threads[i],NULL,churn,(void*)i) == 0);
+    for(int i=0; i<NUM_THREADS; i++)
+        pthread_join(threads[i],NULL);
+
+    // a walk of the arena gives every stacked block back first, none of the threads' blocks is in use
+    // (glibc keeps blocks of its own for the thread stacks it caches)
+    heap_stats walked;
+    assert(_arena_stats(0,&walked));
+    for(int index=0; index<NUM_LOCKFREE_CLASSES; index++)
+        assert(LOCKFREE_TOP(lockfree_stacks[index].head) == NULL && lockfree_stacks[index].count == 0);
+    lock_arena(&main_arena);
+    for(meta_data* block=first_data; block; block=next_block(block))
+        assert(is_block_free(block) || get_block_size(block) < 80 || get_block_size(block) > 96);
+    unlock_arena(&main_arena);
+
+    free(p);
+    free(guard);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+g++ -O2 malloc_3_tests_locks.cpp -o t -lpthread && ./t
+
+The allocator locks: an uncontended acquire is counted and nothing else. A thread that finds the lock
+held spins, and if it is held past the spinning it sleeps in the futex until the release wakes it,
+which counts a contention, a sleep and the time waited, and makes the lock spin longer next time.
+Under threads that all share one arena the counters stay consistent with each other.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include "malloc_3.cpp"
+
+#define NUM_THREADS 4
+#define STEPS 200000
+#define HOLD_MS 50
+
+allocator_lock held_lock=ALLOCATOR_LOCK_INITIALIZER;
+pthread_barrier_t held_barrier;
+
+void sleep_ms(long ms){
+    timespec interval={ms/1000,(ms%1000)*1000000};
+    nanosleep(&interval,NULL);
+}
+
+void* hold(void*){
+    lock_acquire(&held_lock);
+    pthread_barrier_wait(&held_barrier);
+    sleep_ms(HOLD_MS);
+    lock_release(&held_lock);
+    return NULL;
+}
+
+void* churn(void* arg){
+    unsigned int state=(unsigned int)(size_t)arg+1;
+    void* window[16]={};
+    for(int step=0; step<STEPS; step++){
+        state=state*1103515245+12345;
+        int index=(state>>8)%16;
+        free(window[index]);
+        window[index]=malloc(1+(state>>16)%3000);
+    }
+    for(int index=0; index<16; index++)
+        free(window[index]);
+    return NULL;
+}
+
+int main() {
+
+    arena_limit=1;
+
+    // uncontended: one acquisition per heap malloc and free, one of the mapped blocks' lock per mapping
+    void* first=malloc(3000);
+    size_t acquisitions=_num_lock_acquisitions(LOCK_HEAP);
+    size_t contentions=_num_lock_contentions(LOCK_HEAP);
+    void* p=malloc(3000);
+    assert(_num_lock_acquisitions(LOCK_HEAP) == acquisitions + 1);
+    free(p);
+    assert(_num_lock_acquisitions(LOCK_HEAP) == acquisitions + 2);
+    assert(_num_lock_contentions(LOCK_HEAP) == contentions);
+    size_t mmap_acquisitions=_num_lock_acquisitions(LOCK_MMAP);
+    void* mapped=malloc(MMAP_THRESHOLD + 1000);
+    free(mapped);
+    assert(_num_lock_acquisitions(LOCK_MMAP) == mmap_acquisitions + 2);
+
+    // held past the spinning: the waiter sleeps until the release
+    pthread_barrier_init(&held_barrier,NULL,2);
+    pthread_t holder;
+    assert(pthread_create(&holder,NULL,hold,NULL) == 0);
+    pthread_barrier_wait(&held_barrier);
+    lock_acquire(&held_lock);
+    assert(held_lock.acquisitions == 2);
+    assert(held_lock.contentions == 1);
+    assert(held_lock.sleeps == 1);
+    assert(held_lock.wait_ns >= (size_t)HOLD_MS / 2 * 1000000);
+    assert(held_lock.max_wait_ns == held_lock.wait_ns);
+    assert(held_lock.spin_limit == LOCK_MAX_SPINS / 8);
+    lock_release(&held_lock);
+    assert(held_lock.state == 0);
+    pthread_join(holder,NULL);
+
+    // threads of one arena: whatever they met, the counters agree
+    pthread_t threads[NUM_THREADS];
+    for(size_t i=0; i<NUM_THREADS; i++)
+        assert(pthread_create(&threads[i],NULL,churn,(void*)i) == 0);
+    for(int i=0; i<NUM_THREADS; i++)
+        pthread_join(threads[i],NULL);
+    assert(_num_arenas() == 1);
+    assert(main_arena.lock.state == 0);
+    assert(_num_lock_acquisitions(LOCK_HEAP) >= NUM_THREADS * STEPS);
+    assert(_num_lock_contentions(LOCK_HEAP) <= _num_lock_acquisitions(LOCK_HEAP));
+    assert(_num_lock_sleeps(LOCK_HEAP) <= _num_lock_contentions(LOCK_HEAP));
+    assert(_lock_max_wait_ns(LOCK_HEAP) <= _lock_wait_ns(LOCK_HEAP));
+    assert(_num_lock_contentions(LOCK_HEAP) == 0 || _lock_wait_ns(LOCK_HEAP) > 0);
+
+    free(first);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+g++ -O2 malloc_3_tests_maintenance.cpp -o t -lpthread && ./t
+
+The maintenance thread: it is started by the first malloc, which still gets exactly one arena. Between
+the program's own calls it gives the pages of a big free wilderness block back (the block stays usable),
+and frees the blocks other threads left on an arena's remote_frees stack. A fork while threads
+allocate takes every allocator lock first, so the child can allocate too.
+The test makes it wake every 5 ms (MALLOC_3_MAINTENANCE_MS is read at the first malloc, which the C++
+runtime makes before main), and sets arena_limit so the threads have arenas of their own.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include <sys/wait.h>
+
+#define MAINTENANCE_THREAD 1
+#include "malloc_3.cpp"
+
+#define BIG 40000                   //heap blocks, four of them make a free wilderness past TRIM_THRESHOLD
+#define FORKS 30
+
+pthread_barrier_t allocated_barrier;
+pthread_barrier_t exit_barrier;
+void* left_on_stack;
+bool stop_work=false;
+
+void* allocate_and_wait(void*){
+    left_on_stack=malloc(1000);
+    void* guard=malloc(100);                            //keeps it from the wilderness
+    pthread_barrier_wait(&allocated_barrier);
+    pthread_barrier_wait(&exit_barrier);
+    free(guard);
+    return NULL;
+}
+
+void* work(void*){
+    void* kept[64]={};
+    for(unsigned int i=0; !__atomic_load_n(&stop_work,__ATOMIC_RELAXED); i++){
+        free(kept[i%64]);
+        kept[i%64]=malloc(16+(i*37)%5000);
+    }
+    for(int k=0; k<64; k++)
+        free(kept[k]);
+    return NULL;
+}
+
+void sleep_ms(long ms){
+    timespec interval={ms/1000,(ms%1000)*1000000};
+    nanosleep(&interval,NULL);
+}
+
+int main() {
+
+    maintenance_interval_ms=5;
+    arena_limit=4;
+
+    // pthread_create allocates while the first malloc starts the maintenance thread
+    void* first=malloc(3000);
+    assert(_num_arenas() == 1);
+    assert(main_arena.num_threads == 1);
+    assert(maintenance_started);
+
+    // the free wilderness gives its pages back, then is handed out whole again
+    char* big[4];
+    for(int i=0; i<4; i++)
+        big[i]=(char*)malloc(BIG);
+    for(int i=3; i>=0; i--)
+        free(big[i]);
+    size_t trims=_num_trims();
+    for(int wait=0; wait<100 && _num_trims() == trims; wait++)
+        sleep_ms(10);
+    assert(_num_trims() > trims);
+    char* again=(char*)malloc(3*BIG);
+    assert(again == big[0]);
+    for(int i=0; i<3*BIG; i+=1000)
+        again[i]=1;
+    free(again);
+
+    // a block pushed on a waiting thread's stack is freed by the maintenance thread
+    pthread_barrier_init(&allocated_barrier,NULL,2);
+    pthread_barrier_init(&exit_barrier,NULL,2);
+    pthread_t waiting;
+    assert(pthread_create(&waiting,NULL,allocate_and_wait,NULL) == 0);
+    pthread_barrier_wait(&allocated_barrier);
+    arena* other=find_arena(left_on_stack);
+    assert(other != &main_arena);
+    size_t free_blocks=_num_free_blocks();
+    free(left_on_stack);
+    assert(_num_free_blocks() == free_blocks);
+    for(int wait=0; wait<100 && __atomic_load_n(&other->remote_frees,__ATOMIC_ACQUIRE) != NULL; wait++)
+        sleep_ms(10);
+    assert(__atomic_load_n(&other->remote_frees,__ATOMIC_ACQUIRE) == NULL);
+    assert(_num_free_blocks() == free_blocks + 1);
+    pthread_barrier_wait(&exit_barrier);
+    pthread_join(waiting,NULL);
+
+    // forks while threads allocate, every child allocates and exits
+    pthread_t workers[4];
+    for(int i=0; i<4; i++)
+        assert(pthread_create(&workers[i],NULL,work,NULL) == 0);
+    for(int round=0; round<FORKS; round++){
+        pid_t pid=fork();
+        assert(pid >= 0);
+        if(pid == 0){
+            void* p=malloc(100);
+            void* q=malloc(3000);
+            void* r=malloc(MMAP_THRESHOLD+1000);
+            free(p);
+            free(q);
+            free(r);
+            _exit(p != NULL && q != NULL && r != NULL ? 0 : 1);
+        }
+        int status=-1;
+        for(int wait=0; wait<500 && waitpid(pid,&status,WNOHANG) != pid; wait++)
+            sleep_ms(10);
+        if(status == -1)
+            kill(pid,SIGKILL);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    __atomic_store_n(&stop_work,true,__ATOMIC_RELAXED);
+    for(int i=0; i<4; i++)
+        pthread_join(workers[i],NULL);
+
+    free(first);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+g++ -O2 malloc_3_tests_mmap.cpp -o t && ./t
+
+Mapped blocks: the data starts MMAP_HEADER_SIZE bytes into a page, and a pointer is a mapped block only
+if its header is in the table of live mappings, so a pointer that merely sits at that page offset (inside
+a mapping, or a mapping already freed) is ignored. The table grows past its first page of slots and
+keeps finding every block while blocks come and go in any order.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#include "malloc_3.cpp"
+
+#define NUM_MAPPED 1500             //more than half of CHUNK_TABLE_MIN, the table grows
+
+unsigned int next_random(unsigned int* state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+int main() {
+
+    size_t size = MMAP_THRESHOLD + 1000;
+    size_t allocated_blocks = _num_allocated_blocks();
+    size_t meta_data_bytes = _num_meta_data_bytes();
+    char* a = (char*)malloc(size);
+    assert(((size_t)a & (MMAP_PAGE_SIZE - 1)) == MMAP_HEADER_SIZE);
+    assert(_num_allocated_blocks() == allocated_blocks + 1);
+    assert(_num_meta_data_bytes() == meta_data_bytes + MMAP_HEADER_SIZE);
+    assert(num_chunks == 1);
+
+    // a page inside a's data, at the offset of a mapped block's data, with a header like a's before it
+    char* inside = a + MMAP_PAGE_SIZE;
+    mmap_chunk* fake = (mmap_chunk*)(inside - MMAP_HEADER_SIZE);
+    fake->block_size = size - MMAP_PAGE_SIZE;
+    fake->mapping_size = MMAP_MAPPING_SIZE(fake->block_size);
+    free(inside);
+    assert(num_chunks == 1 && _num_allocated_blocks() == allocated_blocks + 1);
+    a[size - 1] = 1;
+
+    // a double free
+    free(a);
+    assert(num_chunks == 0 && _num_allocated_blocks() == allocated_blocks);
+    free(a);
+    assert(num_chunks == 0 && _num_allocated_blocks() == allocated_blocks);
+
+    // many mappings, freed (twice), grown and shrunk in a random order
+    static unsigned char* blocks[NUM_MAPPED];
+    for (int i = 0; i < NUM_MAPPED; i++) {
+        blocks[i] = (unsigned char*)malloc(size + i);
+        assert(blocks[i] != NULL);
+        blocks[i][0] = (unsigned char)i;
+    }
+    assert(num_chunks == NUM_MAPPED);
+    assert(chunk_table_size() >= 2 * NUM_MAPPED);
+
+    unsigned int state = 7;
+    size_t live = NUM_MAPPED;
+    for (int step = 0; step < 20000; step++) {
+        int index = (int)(next_random(&state) % NUM_MAPPED);
+        unsigned int action = next_random(&state) % 3;
+        if (blocks[index] == NULL) {
+            blocks[index] = (unsigned char*)malloc(size + index);
+            blocks[index][0] = (unsigned char)index;
+            live++;
+        } else if (action == 0) {
+            free(blocks[index]);
+            free(blocks[index]);
+            blocks[index] = NULL;
+            live--;
+        } else {
+            assert(blocks[index][0] == (unsigned char)index);
+            blocks[index] = (unsigned char*)realloc(blocks[index], size + next_random(&state) % (2 * size));
+            assert(blocks[index] != NULL && blocks[index][0] == (unsigned char)index);
+        }
+        assert(num_chunks == live);
+    }
+
+    for (int i = 0; i < NUM_MAPPED; i++) {
+        assert(blocks[i] == NULL || blocks[i][0] == (unsigned char)i);
+        free(blocks[i]);
+    }
+    assert(num_chunks == 0);
+    assert(_num_allocated_blocks() == allocated_blocks);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+g++ -O2 malloc_3_tests_mremap.cpp -o t && ./t
+
+realloc of mapped blocks: a size that fits the same pages keeps the block as it is, a bigger one remaps
+it with one mremap (no new mapping and copy), a smaller one unmaps the pages past it and keeps the
+address. A block too small for a mapping moves to the heap, and a heap block that can't grow in place
+gets a mapping once it is past the threshold. The contents survive every step.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include "malloc_3.cpp"
+
+void fill(void* p, size_t size, unsigned char seed) {
+    for (size_t i = 0; i < size; i += 512)
+        ((unsigned char*)p)[i] = (unsigned char)(seed + i / 512);
+}
+
+bool filled(void* p, size_t size, unsigned char seed) {
+    for (size_t i = 0; i < size; i += 512)
+        if (((unsigned char*)p)[i] != (unsigned char)(seed + i / 512))
+            return false;
+    return true;
+}
+
+mmap_chunk* chunk_of(void* p) {
+    return (mmap_chunk*)((size_t)p - MMAP_HEADER_SIZE);
+}
+
+int main() {
+
+    size_t size = 200000;
+    void* p = malloc(size);
+    fill(p, size, 1);
+    size_t allocated_bytes = _num_allocated_bytes();
+
+    // the same pages
+    size_t syscalls = _num_syscalls();
+    assert(realloc(p, size + 100) == p);
+    assert(_num_syscalls() == syscalls);
+    assert(_num_allocated_bytes() == allocated_bytes + 100);
+    size += 100;
+
+    // bigger: one mremap
+    void* grown = realloc(p, 2000000);
+    assert(grown != NULL);
+    assert(_num_syscalls() == syscalls + 1);
+    assert(num_chunks == 1);
+    assert(chunk_of(grown)->mapping_size == MMAP_MAPPING_SIZE(2000000));
+    assert(_num_allocated_bytes() == allocated_bytes + 2000000 - 200000);
+    assert(filled(grown, size, 1));
+    fill(grown, 2000000, 2);
+
+    // smaller: the tail is unmapped, the address stays
+    syscalls = _num_syscalls();
+    assert(realloc(grown, 300000) == grown);
+    assert(_num_syscalls() == syscalls + 1);
+    assert(chunk_of(grown)->mapping_size == MMAP_MAPPING_SIZE(300000));
+    assert(_num_allocated_bytes() == allocated_bytes + 300000 - 200000);
+    assert(filled(grown, 300000, 2));
+
+    // too small for a mapping: to the heap
+    void* small = realloc(grown, 5000);
+    assert(small != NULL && find_arena(small) != NULL);
+    assert(num_chunks == 0);
+    assert(filled(small, 5000, 2));
+
+    // and back, from inside the heap (the last block would grow the wilderness)
+    void* guard = malloc(100);
+    void* mapped = realloc(small, 400000);
+    assert(mapped != NULL && find_arena(mapped) == NULL);
+    assert(((size_t)mapped & (MMAP_PAGE_SIZE - 1)) == MMAP_HEADER_SIZE);
+    assert(num_chunks == 1);
+    assert(filled(mapped, 5000, 2));
+
+    free(mapped);
+    free(guard);
+    assert(num_chunks == 0);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+g++ -O2 malloc_3_tests_percpu.cpp -o t -lpthread && ./t
+GLIBC_TUNABLES=glibc.pthread.rseq=0 ./t
+
+The per CPU caches: the bins belong to a CPU, so a block one thread frees is the next block of its bin
+for any thread on that CPU, also after the thread that freed it exited. A double free of a cached block
+is ignored. Threads on one CPU preempt each other in the middle of their pushes and pops, which the
+restartable sequences survive. The threads are pinned to one CPU, so they share its bins.
+Without an rseq area the bins are the thread's, and a thread's bins go back to the heap when it exits.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#define PERCPU_CACHE 1
+#include "malloc_3.cpp"
+
+#define NUM_THREADS 4
+#define STEPS 1000000
+#define WINDOW 8
+
+cpu_set_t one_cpu;
+void* freed_by_thread;
+
+void* free_and_exit(void*){
+    sched_setaffinity(0,sizeof(one_cpu),&one_cpu);
+    void* p=malloc(40);
+    freed_by_thread=p;
+    free(p);
+    return NULL;
+}
+
+void* churn(void* arg){
+    sched_setaffinity(0,sizeof(one_cpu),&one_cpu);
+    unsigned int state=(unsigned int)(size_t)arg+1;
+    unsigned char* window[WINDOW]={};
+    for(int step=0; step<STEPS; step++){
+        state=state*1103515245+12345;
+        int index=(state>>8)%WINDOW;
+        if(window[index]!=NULL){
+            for(int i=0; i<48; i++)
+                assert(window[index][i]==(unsigned char)(index+(size_t)arg*WINDOW));
+            free(window[index]);
+        }
+        window[index]=(unsigned char*)malloc(33+(state>>16)%16);  //one bin
+        for(int i=0; i<48; i++)
+            window[index][i]=(unsigned char)(index+(size_t)arg*WINDOW);
+    }
+    for(int index=0; index<WINDOW; index++)
+        free(window[index]);
+    return NULL;
+}
+
+int main() {
+
+    CPU_ZERO(&one_cpu);
+    CPU_SET(sched_getcpu(),&one_cpu);
+    sched_setaffinity(0,sizeof(one_cpu),&one_cpu);
+
+    // a freed block is the next one of its bin, and stays in use while it is cached
+    void* p=malloc(40);
+    size_t free_blocks=_num_free_blocks();
+    free(p);
+    assert(_num_free_blocks() == free_blocks);
+    assert(malloc(40) == p);
+
+    // a double free doesn't cache it twice
+    free(p);
+    free(p);
+    void* q=malloc(40);
+    void* r=malloc(40);
+    assert(q == p && r != p);
+
+    if(use_cpu_caches()){
+        // a thread's freed block is in the CPU's bin after it exits
+        pthread_t thread;
+        assert(pthread_create(&thread,NULL,free_and_exit,NULL) == 0);
+        pthread_join(thread,NULL);
+        void* s=malloc(40);
+        assert(s == freed_by_thread);
+        free(s);
+    }else{
+        // a thread cache instead, it goes back to the heap when the thread exits
+        pthread_t thread;
+        assert(pthread_create(&thread,NULL,free_and_exit,NULL) == 0);
+        pthread_join(thread,NULL);
+        assert(find_block_unlocked(freed_by_thread) == NULL);
+    }
+
+    // threads of one CPU push and pop the same bins
+    pthread_t threads[NUM_THREADS];
+    for(size_t i=0; i<NUM_THREADS; i++)
+        assert(pthread_create(&threads[i],NULL,churn,(void*)i) == 0);
+    for(int i=0; i<NUM_THREADS; i++)
+        pthread_join(threads[i],NULL);
+
+    free(q);
+    free(r);
+    printf("TEST FINISHED\n");
+    return 0;
+}
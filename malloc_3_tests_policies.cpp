@@ -0,0 +1,218 @@
+/*
+g++ -O2 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DFIT_POLICY=TLSF_FIT malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DFIT_POLICY=BEST_FIT malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DBOUNDARY_TAGS=1 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DCOMPACT_HEADER=1 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DSLAB_ALLOCATOR=1 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DTCACHE_COUNT=16 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DPERCPU_CACHE=1 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DLOCKFREE_LISTS=1 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DREALLOC_SLACK=1 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DHEAP_CHUNK_SIZE=65536 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DMAINTENANCE_THREAD=1 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DSLAB_ALLOCATOR=1 -DMAINTENANCE_THREAD=1 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DTCACHE_COUNT=16 -DLOCKFREE_LISTS=1 malloc_3_tests_policies.cpp -o t && ./t
+g++ -O2 -DPERCPU_CACHE=1 -DREALLOC_SLACK=1 malloc_3_tests_policies.cpp -o t && ./t
+
+The same behaviour under every configuration of malloc_3.cpp: contents survive malloc, realloc and
+neighbours' frees, foreign pointers and double frees are ignored, and the statistics follow the heap.
+The statistics are checked on blocks bigger than anything the caches, slabs and lock-free stacks take,
+those count as in use while they are cached.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include "malloc_3.cpp"
+
+#define BIG 3000                    //bigger than TCACHE_MAX_SIZE, SLAB_MAX_SIZE and LOCKFREE_MAX_SIZE
+#define LIVE 512
+#define STEPS 20000
+
+struct counts{
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t allocated_blocks;
+    size_t allocated_bytes;
+    size_t meta_data_bytes;
+};
+
+counts take_counts(){
+    counts now;
+    now.free_blocks=_num_free_blocks();
+    now.free_bytes=_num_free_bytes();
+    now.allocated_blocks=_num_allocated_blocks();
+    now.allocated_bytes=_num_allocated_bytes();
+    now.meta_data_bytes=_num_meta_data_bytes();
+    return now;
+}
+
+bool same_counts(counts a, counts b){
+    return a.free_blocks==b.free_blocks && a.free_bytes==b.free_bytes &&
+           a.allocated_blocks==b.allocated_blocks && a.allocated_bytes==b.allocated_bytes &&
+           a.meta_data_bytes==b.meta_data_bytes;
+}
+
+void fill(void* p, size_t size, unsigned char seed){
+    for(size_t i=0; i<size; i++)
+        ((unsigned char*)p)[i]=(unsigned char)(seed+i*7);
+}
+
+bool filled(void* p, size_t size, unsigned char seed){
+    for(size_t i=0; i<size; i++)
+        if(((unsigned char*)p)[i]!=(unsigned char)(seed+i*7))
+            return false;
+    return true;
+}
+
+unsigned int next_random(unsigned int* state){
+    *state=*state*1103515245+12345;
+    return *state>>8;
+}
+
+int main() {
+
+    assert(malloc(0) == NULL);
+    assert(malloc(MAX_SIZE + 1) == NULL);
+    assert(calloc(MAX_SIZE, 2) == NULL);
+    assert(realloc(NULL, 0) == NULL);
+
+    // the first heap block of a thread may start the maintenance thread, which allocates too
+    // (a small block may come from a slab and not reach the heap)
+    void* first=malloc(BIG);
+    assert(first != NULL);
+
+    // a new block is counted with its header
+    counts before=take_counts();
+    void* b1=malloc(BIG);
+    counts after=take_counts();
+    assert(b1 != NULL);
+    assert(after.allocated_blocks == before.allocated_blocks + 1);
+    assert(after.allocated_bytes == before.allocated_bytes + BIG);
+    assert(after.meta_data_bytes == before.meta_data_bytes + _size_meta_data());
+    assert(after.free_blocks == before.free_blocks);
+    assert(after.free_bytes == before.free_bytes);
+    fill(b1, BIG, 1);
+
+    // b3 keeps b2 from merging with the wilderness
+    void* b2=malloc(BIG);
+    void* b3=malloc(BIG);
+    fill(b2, BIG, 2);
+    fill(b3, BIG, 3);
+
+    // a freed block stays counted, as free
+    before=take_counts();
+    free(b2);
+    after=take_counts();
+    assert(after.free_blocks == before.free_blocks + 1);
+    assert(after.free_bytes == before.free_bytes + BIG);
+    assert(after.allocated_blocks == before.allocated_blocks);
+    assert(after.allocated_bytes == before.allocated_bytes);
+    assert(filled(b1, BIG, 1) && filled(b3, BIG, 3));
+
+    // a double free, and pointers that are not ours, change nothing
+    int on_stack[4];
+    before=take_counts();
+    free(b2);
+    free(on_stack);
+    free((char*)b1 + 16);
+    free(NULL);
+    after=take_counts();
+    assert(same_counts(before, after));
+    assert(filled(b1, BIG, 1) && filled(b3, BIG, 3));
+
+    // the free block is reused, but TLSF searches the lists above the request's, past an exact fit
+    void* b4=malloc(BIG);
+#if FIT_POLICY!=TLSF_FIT
+    assert(b4 == b2);
+    after=take_counts();
+    assert(after.free_blocks == before.free_blocks - 1);
+    assert(after.free_bytes == before.free_bytes - BIG);
+#endif
+    fill(b4, BIG, 4);
+
+    // realloc keeps the contents, in place or not
+    b1=realloc(b1, 2 * BIG);
+    assert(b1 != NULL && filled(b1, BIG, 1));
+    fill(b1, 2 * BIG, 5);
+    b1=realloc(b1, BIG / 2);
+    assert(b1 != NULL && filled(b1, BIG / 2, 5));
+    assert(filled(b3, BIG, 3) && filled(b4, BIG, 4));
+
+    // a mapped block is counted while it lives
+    before=take_counts();
+    void* mapped=malloc(MMAP_THRESHOLD + BIG);
+    assert(mapped != NULL);
+    after=take_counts();
+    assert(after.allocated_blocks == before.allocated_blocks + 1);
+    assert(after.allocated_bytes == before.allocated_bytes + MMAP_THRESHOLD + BIG);
+    fill(mapped, MMAP_THRESHOLD + BIG, 6);
+    mapped=realloc(mapped, 2 * MMAP_THRESHOLD);
+    assert(mapped != NULL && filled(mapped, MMAP_THRESHOLD + BIG, 6));
+    free(mapped);
+
+    // calloc zeroes what the block held before
+    free(b4);
+    unsigned char* zeroed=(unsigned char*)calloc(BIG / 4, 4);
+    assert(zeroed != NULL);
+    for(size_t i=0; i<BIG; i++)
+        assert(zeroed[i] == 0);
+    free(zeroed);
+
+    // small blocks go through the caches, a double free must not hand one block out twice
+    void* s1=malloc(40);
+    void* s2=malloc(40);
+    free(s1);
+    free(s1);
+    void* s3=malloc(40);
+    void* s4=malloc(40);
+    assert(s3 != s4 && s3 != s2 && s4 != s2);
+    free(s2);
+    free(s3);
+    free(s4);
+
+    // random malloc, realloc and free of every size class, nothing overwrites a live block
+    void* blocks[LIVE]={};
+    size_t sizes[LIVE]={};
+    unsigned int state=3;
+    for(int step=0; step<STEPS; step++){
+        int index=(int)(next_random(&state)%LIVE);
+        size_t size=1 + next_random(&state) % (next_random(&state) % 8 == 0 ? 3 * BIG : 300);
+        if(blocks[index] != NULL)
+            assert(filled(blocks[index], sizes[index], (unsigned char)index));
+        switch(next_random(&state) % 3){
+            case 0:
+                free(blocks[index]);
+                blocks[index]=malloc(size);
+                break;
+            case 1:
+                blocks[index]=realloc(blocks[index], size);
+                if(blocks[index] != NULL && sizes[index] != 0)
+                    assert(filled(blocks[index], size < sizes[index] ? size : sizes[index], (unsigned char)index));
+                break;
+            default:
+                free(blocks[index]);
+                blocks[index]=NULL;
+                size=0;
+                break;
+        }
+        if(blocks[index] == NULL)
+            size=0;
+        sizes[index]=size;
+        fill(blocks[index], size, (unsigned char)index);
+    }
+    for(int index=0; index<LIVE; index++){
+        assert(blocks[index] == NULL || filled(blocks[index], sizes[index], (unsigned char)index));
+        free(blocks[index]);
+    }
+
+    counts last=take_counts();
+    assert(last.free_blocks <= last.allocated_blocks);
+    assert(last.free_bytes <= last.allocated_bytes);
+
+    free(first);
+    free(b1);
+    free(b3);
+    printf("TEST FINISHED\n");
+    return 0;
+}
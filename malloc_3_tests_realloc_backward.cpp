@@ -0,0 +1,80 @@
+/*
+g++ -O2 malloc_3_tests_realloc_backward.cpp -o t && ./t
+
+realloc into the neighbours: a block that can't grow forward takes the free block before it (and the
+one after it, if the one before is not enough), its data moves down to the start of the free block.
+The last block of the heap grows with the wilderness, and when the break can't move it still gets
+a new block (here, a mapping) and its data is copied there.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include <sys/mman.h>
+#include "malloc_3.cpp"
+
+void fill(void* p, size_t size, unsigned char seed) {
+    for (size_t i = 0; i < size; i++)
+        ((unsigned char*)p)[i] = (unsigned char)(seed + i * 3);
+}
+
+bool filled(void* p, size_t size, unsigned char seed) {
+    for (size_t i = 0; i < size; i++)
+        if (((unsigned char*)p)[i] != (unsigned char)(seed + i * 3))
+            return false;
+    return true;
+}
+
+int main() {
+
+    // backward: a is free, b grows into it
+    void* a = malloc(1000);
+    void* b = malloc(1000);
+    void* guard1 = malloc(100);
+    fill(b, 1000, 1);
+    free(a);
+    size_t free_blocks = _num_free_blocks();
+    void* ab = realloc(b, 1950);
+    assert(ab == a);
+    assert(filled(ab, 1000, 1));
+    assert(_num_free_blocks() == free_blocks - 1);
+
+    // both ways: c and e are free, d takes all three
+    void* c = malloc(1000);
+    void* d = malloc(1000);
+    void* e = malloc(1000);
+    void* guard2 = malloc(100);
+    fill(d, 1000, 2);
+    free(c);
+    free(e);
+    free_blocks = _num_free_blocks();
+    void* cde = realloc(d, 3000 + 2 * _size_meta_data());
+    assert(cde == c);
+    assert(filled(cde, 1000, 2));
+    assert(_num_free_blocks() == free_blocks - 2);
+
+    // the last block, with a wall right after the program break
+    char* last = (char*)malloc(100000);
+    fill(last, 100000, 3);
+    char* program_break = (char*)sbrk(0);
+    void* wall = mmap(program_break + (MMAP_PAGE_SIZE - (size_t)program_break % MMAP_PAGE_SIZE) % MMAP_PAGE_SIZE,
+                      MMAP_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    assert(wall != MAP_FAILED);
+
+    // the heap can't grow: a heap sized request fails and leaves the block as it was
+    assert(realloc(last, 120000) == NULL);
+    assert(filled(last, 100000, 3));
+
+    // a mapping can still take it
+    char* mapped = (char*)realloc(last, MMAP_THRESHOLD + 1000);
+    assert(mapped != NULL && find_arena(mapped) == NULL);
+    assert(filled(mapped, 100000, 3));
+
+    munmap(wall, MMAP_PAGE_SIZE);
+    free(mapped);
+    free(ab);
+    free(cde);
+    free(guard1);
+    free(guard2);
+    printf("TEST FINISHED\n");
+    return 0;
+}
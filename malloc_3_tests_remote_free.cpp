@@ -0,0 +1,110 @@
+/*
+g++ -O2 malloc_3_tests_remote_free.cpp -o t -lpthread && ./t
+
+Remote frees: a block freed by a thread of another arena is pushed on its owner's remote_frees stack,
+without the owner's lock, and stays in use until the owner drains the stack (its next malloc or free,
+or a walk of its statistics). A second free of a block on the stack is not pushed again, it drains the
+stack and is then ignored like any double free. Many threads push on one stack at once.
+arena_limit is set by the test, so it doesn't depend on the number of CPUs.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include "malloc_3.cpp"
+
+#define NUM_BLOCKS 4000
+#define NUM_FREERS 4
+
+pthread_barrier_t allocated_barrier;
+pthread_barrier_t freed_barrier;
+pthread_barrier_t malloc_barrier;
+pthread_barrier_t exit_barrier;
+void* blocks[NUM_BLOCKS];           //the owner's, freed by others
+void* guard;
+void* drained_by_malloc;
+
+void* owner(void*){
+    for(int i=0; i<NUM_BLOCKS; i++){
+        blocks[i]=malloc(64 + i % 200);
+        ((char*)blocks[i])[0]=(char)i;
+    }
+    guard=malloc(100);
+    pthread_barrier_wait(&allocated_barrier);
+    pthread_barrier_wait(&freed_barrier);
+    drained_by_malloc=malloc(100);                      //drains what the main thread pushed
+    pthread_barrier_wait(&malloc_barrier);
+    pthread_barrier_wait(&exit_barrier);
+    return NULL;
+}
+
+void* freer(void* arg){
+    for(int i=(int)(size_t)arg+2; i<NUM_BLOCKS; i+=NUM_FREERS)
+        free(blocks[i]);
+    return NULL;
+}
+
+size_t in_use_bytes(){
+    heap_stats stats;
+    _stats_snapshot(&stats);
+    return stats.allocated_bytes-stats.free_bytes;
+}
+
+int main() {
+
+    arena_limit=2;
+    void* own=malloc(100);
+    assert(find_arena(own) == &main_arena);
+
+    pthread_barrier_init(&allocated_barrier,NULL,2);
+    pthread_barrier_init(&freed_barrier,NULL,2);
+    pthread_barrier_init(&malloc_barrier,NULL,2);
+    pthread_barrier_init(&exit_barrier,NULL,2);
+    pthread_t owner_thread;
+    assert(pthread_create(&owner_thread,NULL,owner,NULL) == 0);
+    pthread_barrier_wait(&allocated_barrier);
+    arena* other=find_arena(blocks[0]);
+    assert(other == arenas[1]);
+
+    // pushed, not freed: the block is still in use and linked on the stack
+    size_t free_blocks=_num_free_blocks();
+    size_t in_use=in_use_bytes();
+    free(blocks[0]);
+    assert(other->remote_frees == blocks[0]);
+    assert(((void**)blocks[0])[1] == (void*)REMOTE_FREE_KEY);
+    assert(_num_free_blocks() == free_blocks);
+    assert(in_use_bytes() == in_use);
+
+    // a double free drains the stack, the block is freed once
+    free(blocks[0]);
+    assert(other->remote_frees == NULL);
+    assert(_num_free_blocks() == free_blocks + 1);
+    assert(in_use_bytes() < in_use);
+
+    // the owner's next malloc drains its stack
+    free(blocks[1]);
+    assert(other->remote_frees == blocks[1]);
+    pthread_barrier_wait(&freed_barrier);
+    pthread_barrier_wait(&malloc_barrier);
+    assert(other->remote_frees == NULL);
+    assert(find_arena(drained_by_malloc) == other);
+
+    // threads of both arenas free the rest of the owner's blocks at once, a walk drains the stack
+    pthread_t freers[NUM_FREERS];
+    for(size_t i=0; i<NUM_FREERS; i++)
+        assert(pthread_create(&freers[i],NULL,freer,(void*)i) == 0);
+    for(int i=0; i<NUM_FREERS; i++)
+        pthread_join(freers[i],NULL);
+    heap_stats walked;
+    assert(_arena_stats(1,&walked));
+    assert(other->remote_frees == NULL);
+    // only the guard and the block the owner took are left in use
+    assert(walked.allocated_blocks - walked.free_blocks == 2);
+
+    pthread_barrier_wait(&exit_barrier);
+    pthread_join(owner_thread,NULL);
+    free(guard);
+    free(drained_by_malloc);
+    free(own);
+    printf("TEST FINISHED\n");
+    return 0;
+}
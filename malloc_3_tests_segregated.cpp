@@ -0,0 +1,62 @@
+/*
+g++ -O2 malloc_3_tests_segregated.cpp -o t && ./t
+
+The segregated free lists: an exact class gives back the block freed to it, a power of two class is
+searched first fit (a block further down the list is taken before a bigger class or a new block),
+and a request with an empty class takes a block of a bigger class.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#define FIT_POLICY SEGREGATED_FIT
+#include "malloc_3.cpp"
+
+int main() {
+
+    // guards keep the freed blocks from merging with each other and with the wilderness
+    void *g1, *g2, *g3, *g4;
+    void *small, *b600, *b700, *b5000;
+    small = malloc(40);
+    g1 = malloc(40);
+    b700 = malloc(700);
+    g2 = malloc(40);
+    b600 = malloc(600);
+    g3 = malloc(40);
+    b5000 = malloc(5000);
+    g4 = malloc(40);
+
+    // an exact class: the block freed to it comes back
+    free(small);
+    assert(malloc(40) == small);
+
+    // [512,1024): the head (600, freed last) is too small for 650, the 700 block after it fits
+    free(b700);
+    free(b600);
+    size_t free_blocks = _num_free_blocks();
+    size_t allocated_blocks = _num_allocated_blocks();
+    void* b650 = malloc(650);
+    assert(b650 == b700);
+    assert(_num_free_blocks() == free_blocks - 1);
+    assert(_num_allocated_blocks() == allocated_blocks);
+
+    // 600 is still the head of its class
+    assert(malloc(520) == b600);
+
+    // an empty class takes the head of a bigger class, split
+    free(b5000);
+    allocated_blocks = _num_allocated_blocks();
+    void* b300 = malloc(300);
+    assert(b300 == b5000);
+    assert(_num_allocated_blocks() == allocated_blocks + 1);
+    assert(_num_free_blocks() == 1);
+
+    free(b300);
+    free(b650);
+    free(g1);
+    free(g2);
+    free(g3);
+    free(g4);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+g++ -O2 malloc_3_tests_slab.cpp -o t && ./t
+
+The slab tier: small requests are objects of a page of their size class, counted as blocks of the page
+with the page header as their meta data. A freed object is the next one its page gives, pointers into
+an object and double frees are ignored, realloc stays in the object while it fits, and a page that
+empties goes back to the pool, where any class can take it.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#define SLAB_ALLOCATOR 1
+#include "malloc_3.cpp"
+
+slab_page* page_of(void* p) {
+    return (slab_page*)((size_t)p & ~((size_t)SLAB_PAGE_SIZE - 1));
+}
+
+int main() {
+
+    // the first object of a class brings a page, all of its objects are counted
+    size_t allocated_blocks = _num_allocated_blocks();
+    size_t meta_data_bytes = _num_meta_data_bytes();
+    char* a = (char*)malloc(40);
+    assert(a >= slab_region && a < slab_cursor);
+    slab_page* page = page_of(a);
+    assert(page->object_size == 48);
+    assert(_num_allocated_blocks() == allocated_blocks + page->num_objects);
+    assert(_num_allocated_bytes() >= page->num_objects * 48);
+    assert(_num_meta_data_bytes() == meta_data_bytes + SLAB_HEADER_SIZE);
+    assert(_num_free_blocks() == page->num_objects - 1);
+
+    // the same class, the same page, side by side
+    char* b = (char*)malloc(48);
+    char* c = (char*)malloc(33);
+    assert(b - a == 48 && c - b == 48);
+    assert(_num_free_blocks() == page->num_objects - 3);
+
+    // a freed object is given next
+    free(a);
+    assert(_num_free_blocks() == page->num_objects - 2);
+    assert(malloc(40) == a);
+
+    // a double free and a pointer into an object change nothing
+    free(b);
+    size_t free_blocks = _num_free_blocks();
+    free(b);
+    free(a + 16);
+    free(c + 1);
+    assert(_num_free_blocks() == free_blocks);
+    char* b1 = (char*)malloc(48);
+    char* b2 = (char*)malloc(48);
+    assert(b1 == b && b2 != b && b2 != a && b2 != c);
+
+    // realloc stays in the object while it fits, out of it the contents move
+    for (int i = 0; i < 48; i++)
+        a[i] = (char)i;
+    assert(realloc(a, 48) == a);
+    char* moved = (char*)realloc(a, 200);
+    assert(moved != a && page_of(moved)->object_size == 208);
+    for (int i = 0; i < 48; i++)
+        assert(moved[i] == (char)i);
+    // the old object was freed by the move
+    a = (char*)malloc(40);
+    assert(page_of(a) == page);
+
+    // a full page leaves its class a second page, the first page goes back to the pool once it empties
+    slab_page* second = NULL;
+    char* objects[SLAB_PAGE_SIZE / 256 + 1];
+    int num = 0;
+    do {
+        objects[num] = (char*)malloc(256);
+        if (page_of(objects[num]) != page_of(objects[0]))
+            second = page_of(objects[num]);
+        num++;
+    } while (second == NULL);
+    assert((size_t)num == page_of(objects[0])->num_objects + 1);
+    slab_page* first = page_of(objects[0]);
+    allocated_blocks = _num_allocated_blocks();
+    for (int i = 0; i < num - 1; i++)
+        free(objects[i]);
+    assert(_num_allocated_blocks() == allocated_blocks - first->num_objects);
+    assert(empty_slabs == first);
+
+    // another class takes it
+    char* other = (char*)malloc(100);
+    assert(page_of(other) == first && first->object_size == 112);
+
+    free(other);
+    free(objects[num - 1]);
+    free(moved);
+    free(a);
+    free(b1);
+    free(b2);
+    free(c);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+g++ -O2 malloc_3_tests_slack.cpp -o t && ./t
+
+Realloc slack: a block that grows GROWTH_STREAK times in a row is given twice the size it asked for,
+and the growths after that happen in place. The slack goes back when a realloc shrinks the block, and
+when the block drops out of its arena's GROWTH_SLOTS slots. Small blocks never get slack.
+The contents survive all of it.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#define REALLOC_SLACK 1
+#include "malloc_3.cpp"
+
+size_t capacity(void* p) {
+    return get_block_size((meta_data*)((size_t)p - ALIGNED_META_DATA));
+}
+
+void fill(void* p, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++)
+        ((unsigned char*)p)[i] = (unsigned char)(i * 5);
+}
+
+bool filled(void* p, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        if (((unsigned char*)p)[i] != (unsigned char)(i * 5))
+            return false;
+    return true;
+}
+
+int main() {
+
+    // each growth moves the block until the streak, the last move takes twice the size
+    void* guard = malloc(100);
+    char* p = (char*)malloc(3000);
+    fill(p, 0, 3000);
+    p = (char*)realloc(p, 3100);
+    fill(p, 3000, 3100);
+    assert(capacity(p) == 3100);
+    p = (char*)realloc(p, 3200);
+    fill(p, 3100, 3200);
+    assert(capacity(p) == 6400);
+    void* after = malloc(100);                          //p is not the wilderness any more
+
+    // growths up to the slack stay in place
+    for (size_t size = 3300; size <= 6400; size += 100) {
+        char* grown = (char*)realloc(p, size);
+        assert(grown == p);
+        fill(grown, size - 100, size);
+    }
+    assert(capacity(p) == 6400);
+    assert(filled(p, 6400));
+
+    // a shrink gives the slack back
+    size_t free_bytes = _num_free_bytes();
+    assert(realloc(p, 4000) == p);
+    assert(capacity(p) == 4000);
+    assert(_num_free_bytes() > free_bytes);
+    assert(filled(p, 4000));
+
+    // another block gets slack, then GROWTH_SLOTS other growing blocks push it out of its slot
+    char* q = (char*)malloc(3000);
+    fill(q, 0, 3000);
+    q = (char*)realloc(q, 3100);
+    fill(q, 3000, 3100);
+    q = (char*)realloc(q, 3200);
+    fill(q, 3100, 3200);
+    assert(capacity(q) == 6400);
+    void* others[GROWTH_SLOTS];
+    for (int i = 0; i < GROWTH_SLOTS; i++) {
+        others[i] = malloc(2500);
+        others[i] = realloc(others[i], 2600);
+    }
+    assert(capacity(q) == 3200);
+    assert(filled(q, 3200));
+
+    // small blocks grow one step at a time
+    char* small = (char*)malloc(100);
+    for (size_t size = 200; size <= 1000; size += 100)
+        small = (char*)realloc(small, size);
+    assert(capacity(small) == 1000);
+
+    free(small);
+    for (int i = 0; i < GROWTH_SLOTS; i++)
+        free(others[i]);
+    free(q);
+    free(p);
+    free(after);
+    free(guard);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+g++ -O2 malloc_3_tests_stats.cpp -o t -lpthread && ./t
+g++ -O2 -DTCACHE_COUNT=16 malloc_3_tests_stats.cpp -o t -lpthread && ./t
+
+The statistics counters: a query sums every thread's counters while the threads allocate, and each
+thread's counters are read whole, so every header is counted with its block even in the middle of the
+run. Once the threads are done, the totals are what a walk of every arena finds (no mapped blocks are
+left, and the walks drain the remote_frees stacks first). arena_limit is set by the test, so the
+threads have arenas of their own on any machine.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include "malloc_3.cpp"
+
+#define NUM_THREADS 6
+#define STEPS 400000
+#define WINDOW 64
+#define NUM_SLOTS 16
+
+void* slots[NUM_SLOTS];             //blocks freed by a thread that didn't allocate them
+bool done=false;
+
+void* churn(void* arg){
+    unsigned int state=(unsigned int)(size_t)arg*31+1;
+    void* window[WINDOW]={};
+    for(int step=0; step<STEPS; step++){
+        state=state*1103515245+12345;
+        int index=(state>>8)%WINDOW;
+        if(state%5==0){
+            window[index]=__atomic_exchange_n(&slots[(state>>20)%NUM_SLOTS],window[index],__ATOMIC_ACQ_REL);
+            continue;
+        }
+        free(window[index]);
+        window[index]=malloc(1+(state>>16)%(state%7==0 ? 20000 : 500));
+    }
+    for(int index=0; index<WINDOW; index++)
+        free(window[index]);
+    return NULL;
+}
+
+void* read_stats(void*){
+    size_t queries=0;
+    while(!__atomic_load_n(&done,__ATOMIC_ACQUIRE) || queries==0){
+        heap_stats stats;
+        _stats_snapshot(&stats);
+        assert(stats.meta_data_bytes == stats.allocated_blocks * _size_meta_data());
+        queries++;
+    }
+    return NULL;
+}
+
+int main() {
+
+    arena_limit=4;
+
+    pthread_t reader;
+    pthread_t threads[NUM_THREADS];
+    assert(pthread_create(&reader,NULL,read_stats,NULL) == 0);
+    for(size_t i=0; i<NUM_THREADS; i++)
+        assert(pthread_create(&threads[i],NULL,churn,(void*)i) == 0);
+    for(int i=0; i<NUM_THREADS; i++)
+        pthread_join(threads[i],NULL);
+    __atomic_store_n(&done,true,__ATOMIC_RELEASE);
+    pthread_join(reader,NULL);
+
+    for(int slot=0; slot<NUM_SLOTS; slot++)
+        free(slots[slot]);
+
+    // quiescent: the totals are the walks
+    heap_stats walked={};
+    for(size_t index=0; index<_num_arenas(); index++){
+        heap_stats arena_walk;
+        assert(_arena_stats(index,&arena_walk));
+        walked.free_blocks+=arena_walk.free_blocks;
+        walked.free_bytes+=arena_walk.free_bytes;
+        walked.allocated_blocks+=arena_walk.allocated_blocks;
+        walked.allocated_bytes+=arena_walk.allocated_bytes;
+        walked.meta_data_bytes+=arena_walk.meta_data_bytes;
+    }
+    heap_stats none;
+    assert(!_arena_stats(_num_arenas(),&none));
+    heap_stats totals;
+    _stats_snapshot(&totals);
+    assert(totals.free_blocks == walked.free_blocks);
+    assert(totals.free_bytes == walked.free_bytes);
+    assert(totals.allocated_blocks == walked.allocated_blocks);
+    assert(totals.allocated_bytes == walked.allocated_bytes);
+    assert(totals.meta_data_bytes == walked.meta_data_bytes);
+    assert(_num_free_blocks() == totals.free_blocks);
+    assert(_num_allocated_bytes() == totals.allocated_bytes);
+    printf("TEST FINISHED\n");
+    return 0;
+}
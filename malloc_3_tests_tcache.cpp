@@ -0,0 +1,98 @@
+/*
+g++ -O2 malloc_3_tests_tcache.cpp -o t -lpthread && ./t
+
+The thread caches: a freed block comes back to the next malloc of its bin without a lock, a miss
+refills the bin with a batch, a full bin flushes a batch, and cached blocks count as in use until they
+go back to the heap. A double free of a cached block is ignored, and a thread's cache goes back to the
+heap when the thread exits.
+ */
+
+#include <cstdio>
+#include <assert.h>
+
+#define TCACHE_COUNT 16
+#include "malloc_3.cpp"
+
+#define SIZE 200
+#define BIN_SIZE 208                //SIZE rounded up to its bin
+#define THREAD_BLOCKS 10            //two refills, the thread ends up with TCACHE_BATCH*2 cached blocks
+
+void* thread_blocks[THREAD_BLOCKS];
+pthread_barrier_t freed_barrier;
+pthread_barrier_t exit_barrier;
+
+size_t in_use_bytes(){
+    heap_stats stats;
+    _stats_snapshot(&stats);
+    return stats.allocated_bytes-stats.free_bytes;
+}
+
+void* cache_and_exit(void*){
+    for(int i=0; i<THREAD_BLOCKS; i++)
+        thread_blocks[i]=malloc(SIZE);
+    for(int i=0; i<THREAD_BLOCKS; i++)
+        free(thread_blocks[i]);
+    pthread_barrier_wait(&freed_barrier);
+    pthread_barrier_wait(&exit_barrier);
+    return NULL;
+}
+
+int main() {
+
+    // a miss takes a batch from the heap, the whole batch counts as in use
+    size_t misses=_num_tcache_misses();
+    size_t allocated_blocks=_num_allocated_blocks();
+    void* p=malloc(SIZE);
+    assert(_num_tcache_misses() == misses + 1);
+    assert(_num_allocated_blocks() == allocated_blocks + TCACHE_BATCH);
+    assert(_num_free_blocks() == 0);
+
+    // a freed block is the next one of its bin, a hit, and still in use
+    size_t hits=_num_tcache_hits();
+    free(p);
+    assert(_num_free_blocks() == 0);
+    assert(malloc(SIZE) == p);
+    assert(malloc(BIN_SIZE - 10) != p);
+    assert(_num_tcache_hits() == hits + 2);
+    assert(_num_tcache_misses() == misses + 1);
+
+    // a double free of a cached block doesn't cache it twice
+    free(p);
+    free(p);
+    void* q=malloc(SIZE);
+    void* r=malloc(SIZE);
+    assert(q == p && r != p);
+
+    // a full bin gives a batch back to the heap
+    void* blocks[TCACHE_COUNT + 1];
+    for(int i=0; i<=TCACHE_COUNT; i++)
+        blocks[i]=malloc(SIZE);
+    size_t in_use=in_use_bytes();
+    for(int i=0; i<=TCACHE_COUNT; i++)
+        free(blocks[i]);
+    assert(_num_free_blocks() > 0);
+    assert(in_use_bytes() <= in_use - TCACHE_BATCH * BIN_SIZE);
+
+    // an exiting thread gives its cached blocks back
+    pthread_barrier_init(&freed_barrier,NULL,2);
+    pthread_barrier_init(&exit_barrier,NULL,2);
+    pthread_t thread;
+    assert(pthread_create(&thread,NULL,cache_and_exit,NULL) == 0);
+    pthread_barrier_wait(&freed_barrier);
+    in_use=in_use_bytes();
+    pthread_barrier_wait(&exit_barrier);
+    pthread_join(thread,NULL);
+    assert(in_use_bytes() <= in_use - 2 * TCACHE_BATCH * BIN_SIZE);
+
+    // they are free blocks of the heap now, another free of one doesn't put it in this thread's cache
+    size_t free_blocks=_num_free_blocks();
+    free(thread_blocks[0]);
+    assert(_num_free_blocks() == free_blocks);
+    assert(tcache.counts[BIN_SIZE / TCACHE_BIN_STEP - 1] <= TCACHE_COUNT);
+    for(void* cached=tcache.bins[BIN_SIZE / TCACHE_BIN_STEP - 1]; cached; cached=((void**)cached)[0])
+        assert(cached != thread_blocks[0]);
+    free(q);
+    free(r);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+g++ -O2 malloc_3_tests_threads.cpp -o t -lpthread && ./t
+g++ -O2 -DSLAB_ALLOCATOR=1 malloc_3_tests_threads.cpp -o t -lpthread && ./t
+g++ -O2 -DTCACHE_COUNT=16 malloc_3_tests_threads.cpp -o t -lpthread && ./t
+g++ -O2 -DLOCKFREE_LISTS=1 malloc_3_tests_threads.cpp -o t -lpthread && ./t
+g++ -O2 -DPERCPU_CACHE=1 malloc_3_tests_threads.cpp -o t -lpthread && ./t
+MALLOC_3_ARENAS=4 ./t
+
+Thread safety: threads malloc, realloc and free blocks of every tier at once, and hand blocks to each
+other through shared slots, so a block is often freed or grown by a thread that didn't allocate it.
+Every block holds its size and a pattern made of it, a block handed out twice or written by a
+neighbour breaks the pattern. MALLOC_3_ARENAS=4 gives the threads several arenas on any machine.
+ */
+
+#include <cstdio>
+#include <assert.h>
+#include "malloc_3.cpp"
+
+#define NUM_THREADS 8
+#define STEPS 40000
+#define WINDOW 64
+#define NUM_SLOTS 32
+
+void* slots[NUM_SLOTS];                 //blocks on their way between threads
+pthread_barrier_t start_barrier;
+
+unsigned int next_random(unsigned int* state){
+    *state=*state*1103515245+12345;
+    return *state>>8;
+}
+
+//the first word is the size, the rest a pattern of it
+void* fill(void* p, size_t size){
+    if(p==NULL)
+        return NULL;
+    *(size_t*)p=size;
+    for(size_t i=sizeof(size_t); i<size; i++)
+        ((unsigned char*)p)[i]=(unsigned char)(size+i);
+    return p;
+}
+
+void check(void* p){
+    if(p==NULL)
+        return;
+    size_t size=*(size_t*)p;
+    for(size_t i=sizeof(size_t); i<size; i++)
+        assert(((unsigned char*)p)[i]==(unsigned char)(size+i));
+}
+
+size_t random_size(unsigned int* state){
+    switch(next_random(state)%8){
+        case 0: return sizeof(size_t)+next_random(state)%(MMAP_THRESHOLD+8192);    //sometimes mapped
+        case 1: case 2: return sizeof(size_t)+next_random(state)%4000;
+        default: return sizeof(size_t)+next_random(state)%300;
+    }
+}
+
+void* worker(void* arg){
+    unsigned int state=(unsigned int)(size_t)arg*7919+1;
+    void* window[WINDOW]={};
+    pthread_barrier_wait(&start_barrier);
+
+    for(int step=0; step<STEPS; step++){
+        int index=(int)(next_random(&state)%WINDOW);
+        check(window[index]);
+        switch(next_random(&state)%4){
+            case 0:{                                    //free it, malloc another
+                free(window[index]);
+                size_t size=random_size(&state);
+                window[index]=fill(malloc(size),size);
+                break;
+            }
+            case 1:{                                    //realloc keeps the smaller of the two sizes
+                if(window[index]==NULL)
+                    break;
+                size_t old_size=*(size_t*)window[index];
+                size_t size=random_size(&state);
+                unsigned char* moved=(unsigned char*)realloc(window[index],size);
+                assert(moved!=NULL);
+                for(size_t i=sizeof(size_t); i<size && i<old_size; i++)
+                    assert(moved[i]==(unsigned char)(old_size+i));
+                window[index]=fill(moved,size);
+                break;
+            }
+            case 2:{                                    //swap with a slot, another thread frees or keeps ours
+                void* taken=__atomic_exchange_n(&slots[next_random(&state)%NUM_SLOTS],window[index],__ATOMIC_ACQ_REL);
+                check(taken);
+                window[index]=taken;
+                break;
+            }
+            default:
+                free(window[index]);
+                window[index]=NULL;
+                break;
+        }
+    }
+
+    for(int index=0; index<WINDOW; index++){
+        check(window[index]);
+        free(window[index]);
+    }
+    return NULL;
+}
+
+int main() {
+
+    pthread_t threads[NUM_THREADS];
+    pthread_barrier_init(&start_barrier,NULL,NUM_THREADS);
+    for(size_t i=0; i<NUM_THREADS; i++)
+        assert(pthread_create(&threads[i],NULL,worker,(void*)i)==0);
+    for(int i=0; i<NUM_THREADS; i++)
+        pthread_join(threads[i],NULL);
+
+    for(int slot=0; slot<NUM_SLOTS; slot++){
+        check(slots[slot]);
+        free(slots[slot]);
+    }
+
+    heap_stats stats;
+    _stats_snapshot(&stats);
+    assert(stats.free_blocks<=stats.allocated_blocks);
+    assert(stats.free_bytes<=stats.allocated_bytes);
+    assert(stats.meta_data_bytes>=stats.allocated_blocks*_size_meta_data() || SLAB_ALLOCATOR);
+
+    // everything was freed, the heap gives it out again
+    void* again=fill(malloc(3000),3000);
+    check(again);
+    free(again);
+    printf("TEST FINISHED\n");
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include <cstring>
+#include <unistd.h>
+#include <cstdlib>
+
+/*
+ *   Binary buddy allocator, same interface as malloc_3.cpp.
+ *   Every block (meta_data included) is 2^order bytes and starts at an address that is a
+ *   multiple of its size, so the buddy of a block is found by flipping bit 'order' of its address.
+ */
+
+#define MAX_SIZE 100000000
+#define SIZE_NOT_ALIGNED(size) (size%4!=0)
+#define ALIGN_SIZE(size) (4-(size%4))
+#define MIN_ORDER 6                                 //smallest block is 64 bytes (meta_data included)
+#define MAX_ORDER 27                                //2^27 > MAX_SIZE+meta_data
+#define NUM_ORDERS (MAX_ORDER+1)
+#define TOP_BLOCK_SIZE ((size_t)1<<MAX_ORDER)
+
+
+struct meta_data{
+    bool is_free;
+    int order;
+    size_t block_size;              //bytes the user can use: 2^order - ALIGNED_META_DATA
+    void* start_of_alloc;
+    meta_data* next_free;           //links in the free list of this order, used only while is_free
+    meta_data* prev_free;
+};
+
+#define ALIGNED_META_DATA ((sizeof(meta_data)%4==0) ?\
+                    sizeof(meta_data) : sizeof(meta_data)+ALIGN_SIZE(sizeof(meta_data)))
+
+meta_data* free_lists[NUM_ORDERS];
+unsigned int free_orders=0;                         //bit k is on if free_lists[k] is not empty
+char* heap_bottom=NULL;
+char* heap_top=NULL;
+
+size_t num_blocks=0;                                //statistics, kept up to date by split/merge
+size_t num_free_blocks=0;
+size_t num_free_bytes=0;
+size_t num_allocated_bytes=0;
+
+
+
+void push_free_block(meta_data* block){
+    block->is_free=true;
+    block->prev_free=NULL;
+    block->next_free=free_lists[block->order];
+    if(free_lists[block->order]!=NULL)
+        free_lists[block->order]->prev_free=block;
+    free_lists[block->order]=block;
+    free_orders|=(1U<<block->order);
+
+    num_free_blocks++;
+    num_free_bytes+=block->block_size;
+}
+
+void remove_free_block(meta_data* block){
+    if(block->prev_free!=NULL)
+        block->prev_free->next_free=block->next_free;
+    else
+        free_lists[block->order]=block->next_free;
+
+    if(block->next_free!=NULL)
+        block->next_free->prev_free=block->prev_free;
+
+    if(free_lists[block->order]==NULL)
+        free_orders&=~(1U<<block->order);
+
+    block->is_free=false;
+    num_free_blocks--;
+    num_free_bytes-=block->block_size;
+}
+
+void init_block(meta_data* block, int order){
+    block->order=order;
+    block->block_size=((size_t)1<<order)-ALIGNED_META_DATA;
+    block->start_of_alloc=(char*)block+ALIGNED_META_DATA;
+}
+
+int order_of(size_t size){
+    int order=MIN_ORDER;
+    while(((size_t)1<<order)<size+ALIGNED_META_DATA)
+        order++;
+    return order;
+}
+
+meta_data* buddy_of(meta_data* block){
+    return (meta_data*)((size_t)block ^ ((size_t)1<<block->order));
+}
+
+/*
+ *   Adds a new top order block to the heap, aligned to its own size.
+ */
+bool add_top_block(){
+    void* program_break=sbrk(0);
+    size_t misalignment=(size_t)program_break & (TOP_BLOCK_SIZE-1);
+    if(misalignment!=0 && sbrk(TOP_BLOCK_SIZE-misalignment)==(void*)(-1))
+        return false;
+
+    meta_data* block=(meta_data*)sbrk(TOP_BLOCK_SIZE);
+    if(block==(void*)(-1))
+        return false;
+
+    if(heap_bottom==NULL)
+        heap_bottom=(char*)block;
+    heap_top=(char*)block+TOP_BLOCK_SIZE;
+
+    init_block(block,MAX_ORDER);
+    num_blocks++;
+    num_allocated_bytes+=block->block_size;
+    push_free_block(block);
+    return true;
+}
+
+/*
+ *   Cuts block in half, the upper half (its buddy) goes to the free lists.
+ *   Block must not be in a free list.
+ */
+void split_block(meta_data* block){
+    int order=block->order-1;
+    meta_data* buddy=(meta_data*)((char*)block+((size_t)1<<order));
+
+    num_allocated_bytes-=block->block_size;
+    init_block(block,order);
+    init_block(buddy,order);
+    num_blocks++;
+    num_allocated_bytes+=block->block_size+buddy->block_size;
+    push_free_block(buddy);
+}
+
+/*
+ *   Merges block with its buddy as long as the buddy is a free block of the same order.
+ *   Block must not be in a free list. Returns the merged block.
+ */
+meta_data* merge_with_buddies(meta_data* block, int max_order){
+    while(block->order<max_order){
+        meta_data* buddy=buddy_of(block);
+        if(!buddy->is_free || buddy->order!=block->order)
+            break;
+
+        remove_free_block(buddy);
+        num_allocated_bytes-=block->block_size+buddy->block_size;
+        num_blocks--;
+        if(buddy<block){
+            block->start_of_alloc=NULL;             //absorbed header can't be found by user ptr anymore
+            block=buddy;
+        }else{
+            buddy->start_of_alloc=NULL;
+        }
+        init_block(block,block->order+1);
+        num_allocated_bytes+=block->block_size;
+    }
+    return block;
+}
+
+meta_data* find_meta_data_by_user_ptr(void* user_ptr){
+    if(user_ptr==NULL || (char*)user_ptr<heap_bottom || (char*)user_ptr>=heap_top)
+        return NULL;
+
+    meta_data* block=(meta_data*)((char*)user_ptr-ALIGNED_META_DATA);
+    if(block->start_of_alloc!=user_ptr)
+        return NULL;
+
+    return block;
+}
+
+
+
+//--------------------------------------------------------------------------------------------------------//
+//-----------------------------------------Part 2 Functions-----------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+void* malloc(size_t size){
+    if(size == 0 || size > MAX_SIZE)
+        return NULL;
+
+    int order=order_of(size);
+    unsigned int orders=free_orders & (~0U<<order);
+    if(orders==0){
+        if(!add_top_block())
+            return NULL;
+        orders=free_orders & (~0U<<order);
+    }
+
+    meta_data* block=free_lists[__builtin_ctz(orders)];   //smallest order that is big enough
+    remove_free_block(block);
+    while(block->order>order)
+        split_block(block);
+
+    return block->start_of_alloc;
+}
+
+
+void free(void* p){
+    meta_data* to_release=find_meta_data_by_user_ptr(p);
+    if(to_release==NULL || to_release->is_free)
+        return;
+
+    push_free_block(merge_with_buddies(to_release,MAX_ORDER));
+}
+
+
+void* calloc(size_t num, size_t size){
+    if(size!=0 && num>MAX_SIZE/size)
+        return NULL;
+
+    void* ptr = malloc(size*num);
+    if(ptr==NULL)
+        return NULL;
+
+    return std::memset(ptr, 0, size*num);
+}
+
+void* realloc(void* oldp, size_t size){
+    if(size == 0 || size > MAX_SIZE)
+        return NULL;
+
+    meta_data* old_meta_data=find_meta_data_by_user_ptr(oldp);
+    if(old_meta_data==NULL)                             //oldp is NULL or there is no meta_data that holds oldp
+        return malloc(size);
+
+    int order=order_of(size);
+    if(order<=old_meta_data->order){                    //shrink in place, halves we don't need go back
+        while(old_meta_data->order>order)
+            split_block(old_meta_data);
+        return oldp;
+    }
+
+    //grow in place if we are the lower half and every upper buddy up to the needed order is free
+    int free_order=old_meta_data->order;
+    while(free_order<order){
+        meta_data* buddy=(meta_data*)((size_t)old_meta_data ^ ((size_t)1<<free_order));
+        if(buddy<old_meta_data || !buddy->is_free || buddy->order!=free_order)
+            break;
+        free_order++;
+    }
+    if(free_order==order)
+        return merge_with_buddies(old_meta_data,order)->start_of_alloc;
+
+    void* new_start_of_alloc=malloc(size);
+    if(new_start_of_alloc==NULL)                        //if allocation failed we dont free oldp
+        return NULL;
+
+    std::memcpy(new_start_of_alloc, oldp, old_meta_data->block_size);
+    free(oldp);
+    return new_start_of_alloc;
+}
+
+//--------------------------------------------------------------------------------------------------------//
+//-------------------------------------Underline Functions------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+
+size_t _num_free_blocks(){
+    return num_free_blocks;
+}
+
+size_t _num_free_bytes(){
+    return num_free_bytes;
+}
+
+size_t _num_allocated_blocks(){
+    return num_blocks;
+}
+
+size_t _num_allocated_bytes(){
+    return num_allocated_bytes;
+}
+
+size_t _num_meta_data_bytes(){
+    return (_num_allocated_blocks() * sizeof(meta_data));
+}
+
+size_t _size_meta_data(){
+    return sizeof(meta_data);
+}
+
+//--------------------------------------------------------------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
+//--------------------------------------------------------------------------------------------------------//
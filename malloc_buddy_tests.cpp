@@ -0,0 +1,83 @@
+#include <cstdio>
+#include <assert.h>
+
+#define META_SIZE         sizeof(meta_data)
+#include "malloc_buddy.cpp"
+
+#define USABLE(order)     (((size_t)1<<(order))-META_SIZE)
+
+int main() {
+
+    assert(malloc(0) == NULL);
+    assert(malloc(MAX_SIZE + 1) == NULL);
+
+    // first allocation takes a 2^27 block and splits it down to order 10
+    void *b1, *b2, *b3, *b4;
+    b1 = malloc(1000 - META_SIZE);
+    assert(((size_t)b1 - META_SIZE) % 1024 == 0);
+    assert(_num_allocated_blocks() == 1 + (MAX_ORDER - 10));
+    assert(_num_free_blocks() == MAX_ORDER - 10);
+    assert(_num_meta_data_bytes() == _num_allocated_blocks() * META_SIZE);
+
+    // its buddy is the next free order 10 block
+    b2 = malloc(1000 - META_SIZE);
+    assert((char*)b2 - (char*)b1 == 1024);
+    assert(_num_free_blocks() == MAX_ORDER - 11);
+
+    // small requests are rounded up to the smallest order
+    b3 = malloc(1);
+    assert(_num_allocated_blocks() == 2 + (MAX_ORDER - 10) + (10 - MIN_ORDER));
+
+    // freeing everything merges all the buddies back to one top block
+    free(b1);
+    free(b2);
+    free(b3);
+    assert(_num_allocated_blocks() == 1);
+    assert(_num_free_blocks() == 1);
+    assert(_num_free_bytes() == USABLE(MAX_ORDER));
+    assert(_num_allocated_bytes() == USABLE(MAX_ORDER));
+
+    // freeing a foreign pointer or twice changes nothing
+    b1 = malloc(100);
+    free(b1);
+    free(b1);
+    free((char*)b1 + 4);
+    assert(_num_free_blocks() == 1);
+
+    // realloc grows in place when the upper buddies are free
+    b1 = malloc(100);
+    memset(b1, 7, 100);
+    b2 = realloc(b1, 4000);
+    assert(b1 == b2);
+    assert(((char*)b2)[99] == 7);
+    assert(_num_allocated_blocks() == 1 + (MAX_ORDER - 12));
+
+    // ... and moves when the upper buddy is taken
+    b3 = malloc(4000);
+    b4 = realloc(b2, 5000);
+    assert(b4 != b2);
+    assert(((char*)b4)[99] == 7);
+
+    // shrinking an order 13 block to order 8 splits it and gives back the 5 upper halves
+    size_t free_blocks = _num_free_blocks();
+    b4 = realloc(b4, 100);
+    assert(_num_free_blocks() == free_blocks + (13 - 8));
+
+    free(b3);
+    free(b4);
+    assert(_num_allocated_blocks() == 1);
+
+    b1 = calloc(100, 100);
+    for (int i = 0; i < 10000; i++)
+        assert(((char*)b1)[i] == 0);
+    free(b1);
+
+    // the biggest request still fits in a top block
+    b1 = malloc(MAX_SIZE);
+    assert(b1 != NULL);
+    free(b1);
+    assert(_num_allocated_blocks() == 1);
+
+    printf("TEST FINISHED\n");
+    return 0;
+}